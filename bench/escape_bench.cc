@@ -0,0 +1,120 @@
+
+// Checks the vectorized xmlescape/jsonescape against a plain byte at a time
+// reference on random inputs, and compares their speed. "make fuzz" runs a
+// long randomized check only, "make bench" a short check plus the timings.
+
+#include <chrono>
+#include <random>
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include "util.h"
+
+static std::string ref_xmlescape(const std::string &s) {
+	std::string r;
+	for (unsigned char c : s) {
+		switch (c) {
+		case '"':  r += "&quot;"; break;
+		case '&':  r += "&amp;";  break;
+		case '<':  r += "&lt;";   break;
+		case '>':  r += "&gt;";   break;
+		case '\t': r += "&#9;";   break;
+		case '\n': r += "&#10;";  break;
+		case '\r': r += "&#13;";  break;
+		default:
+			if (c >= 0x20)
+				r += c;
+		};
+	}
+	return r;
+}
+
+static std::string ref_jsonescape(const std::string &s) {
+	std::string r;
+	for (unsigned char c : s) {
+		switch (c) {
+		case '"':  r += "\\\""; break;
+		case '\\': r += "\\\\"; break;
+		case '\b': r += "\\b";  break;
+		case '\f': r += "\\f";  break;
+		case '\n': r += "\\n";  break;
+		case '\r': r += "\\r";  break;
+		case '\t': r += "\\t";  break;
+		default:
+			if (c < 0x20) {
+				char tmp[8];
+				snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+				r += tmp;
+			}
+			else
+				r += c;
+		};
+	}
+	return r;
+}
+
+// Random strings, mostly plain text with some specials and high bytes placed
+// anywhere (so both the 16 byte blocks and the tail loop get exercised)
+static std::string random_string(std::mt19937 &rng) {
+	static const char specials[] = "\"&<>\\\t\n\r\b\f\x01\x1f\x7f\x80\xff";
+	std::string s(rng() % 80, 0);
+	unsigned density = rng() % 4 ? 64 : 4;
+	for (auto & c : s) {
+		if (rng() % density == 0)
+			c = specials[rng() % (sizeof(specials) - 1)];
+		else
+			c = 'a' + rng() % 26;
+	}
+	return s;
+}
+
+static bool fuzz(uint64_t iters) {
+	std::mt19937 rng(1234);
+	for (uint64_t i = 0; i < iters; i++) {
+		std::string s = random_string(rng);
+		if (xmlescape(s) != ref_xmlescape(s) || jsonescape(s) != ref_jsonescape(s)) {
+			std::cerr << "Mismatch escaping:";
+			for (unsigned char c : s)
+				fprintf(stderr, " %02x", c);
+			std::cerr << std::endl;
+			return false;
+		}
+	}
+	std::cout << "escape fuzz: " << iters << " inputs OK" << std::endl;
+	return true;
+}
+
+static volatile uint64_t sink;
+
+template<typename F>
+static void bench(const char *name, const std::string &input, F fn) {
+	const unsigned iters = 1000000;
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < iters; i++)
+		sink += fn(input).size();
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count();
+	std::cout << name << ": " << ns / iters << " ns/op" << std::endl;
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1 && std::string(argv[1]) == "fuzz")
+		return fuzz(argc > 2 ? strtoull(argv[2], NULL, 10) : 10000000) ? 0 : 1;
+
+	if (!fuzz(100000))
+		return 1;
+
+	// Typical song titles and paths, with and without chars to escape
+	const std::string clean = "Another Brick in the Wall (Part II) - 2011 Remastered Version";
+	const std::string dirty = "Simon & Garfunkel - \"The Sound of Silence\" <Live>\n";
+	bench("xmlescape (clean)", clean, xmlescape);
+	bench("xmlescape (clean, reference)", clean, ref_xmlescape);
+	bench("xmlescape (escapes)", dirty, xmlescape);
+	bench("xmlescape (escapes, reference)", dirty, ref_xmlescape);
+	bench("jsonescape (clean)", clean, jsonescape);
+	bench("jsonescape (clean, reference)", clean, ref_jsonescape);
+	bench("jsonescape (escapes)", dirty, jsonescape);
+	bench("jsonescape (escapes, reference)", dirty, ref_jsonescape);
+}
+
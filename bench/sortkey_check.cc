@@ -0,0 +1,59 @@
+
+// Checks sortkey and indexletter on a few known names (articles, accents,
+// Greek and Cyrillic). Run with "make check".
+
+#include <iostream>
+#include <string>
+#include "util.h"
+
+static unsigned failed = 0;
+
+static void check(const char *fn, const std::string &in, const std::string &got,
+                  const std::string &want) {
+	if (got != want) {
+		std::cerr << fn << "(\"" << in << "\") is \"" << got << "\", expected \""
+		          << want << "\"" << std::endl;
+		failed++;
+	}
+}
+
+int main() {
+	static const char *keys[][2] = {
+		{"The Who", "who"},
+		{"The  Who", "who"},
+		{"The \tWho", "who"},
+		{"  \"The Who\"", "who\""},
+		{"Theatre", "theatre"},
+		{"The", "the"},
+		{"Los Lobos", "lobos"},
+		{"Les  Négresses Vertes", "negresses vertes"},
+		{"Björk", "bjork"},
+		{"Ωmega", "ωmega"},
+		{"Άλφα", "αλφα"},
+		{"άλφα", "αλφα"},
+		{"ΆΛΦΑ", "αλφα"},
+		{"Ένας", "ενασ"},
+		{"Ώρα", "ωρα"},
+		{"Ђорђе", "ђорђе"},
+	};
+	for (const auto & k : keys)
+		check("sortkey", k[0], sortkey(k[0]), k[1]);
+
+	static const char *letters[][2] = {
+		{"The Who", "W"},
+		{"Björk", "B"},
+		{"Άλφα", "Α"},
+		{"Ώρα", "Ω"},
+		{"Ђорђе", "Ђ"},
+		{"2Pac", "#"},
+	};
+	for (const auto & l : letters)
+		check("indexletter", l[0], indexletter(sortkey(l[0])), l[1]);
+
+	if (failed)
+		return 1;
+	std::cout << "sortkey: " << sizeof(keys) / sizeof(keys[0]) + sizeof(letters) / sizeof(letters[0])
+	          << " checks OK" << std::endl;
+	return 0;
+}
+
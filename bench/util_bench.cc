@@ -0,0 +1,57 @@
+
+// Microbenchmarks for the request parsing helpers (hex ids, URL decoding and
+// query string tokenizing). Run with "make bench".
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include "util.h"
+
+// Keeps results alive so the compiler does not drop the work
+static volatile uint64_t sink;
+
+template<typename F>
+static void bench(const char *name, unsigned iters, F fn) {
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < iters; i++)
+		sink += fn();
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count();
+	std::cout << name << ": " << ns / iters << " ns/op" << std::endl;
+}
+
+int main() {
+	const unsigned iters = 1000000;
+
+	const uint64_t id = 0x1234abcd5678ef90ULL;
+	const std::string hexid = hexencode64(id);
+	bench("hexencode64", iters, [&] { return hexencode64(id).size(); });
+	bench("hexencode64 (raw)", iters, [&] {
+		char out[16];
+		hexencode64(id, out);
+		return (uint64_t)out[7];
+	});
+	bench("hexdecode64", iters, [&] { return hexdecode64(hexid); });
+
+	const std::string plain = "Some%20Album%20Title%20%28Remastered%29";
+	const std::string noesc = "SomeAlbumTitleRemasteredDeluxeEdition";
+	bench("urldec (escaped)", iters, [&] { return urldec(plain).size(); });
+	bench("urldec (no escapes)", iters, [&] { return urldec(noesc).size(); });
+	bench("urldec (raw, escaped)", iters, [&] {
+		char out[64];
+		return (uint64_t)urldec(plain.data(), plain.size(), out);
+	});
+
+	// Typical Subsonic client query
+	const std::string qs = "u=admin&t=26719a1196d2a940705a59634eb18eab&s=c19b2d&v=1.16.1"
+	                       "&c=DSub&f=json&id=" + hexid + "&size=256";
+	bench("tokenize_vars", iters, [&] {
+		uint64_t n = 0;
+		tokenize_vars(qs.data(), qs.size(), [&n] (const char*, size_t kl, const char*, size_t vl) {
+			n += kl + vl;
+		});
+		return n;
+	});
+	bench("parse_vars", iters / 10, [&] { return (uint64_t)parse_vars(qs).size(); });
+}
+
@@ -5,9 +5,20 @@
 // Data model for the database. Represents Artists, Songs and Albums.
 
 #include <cstring>
+#include <iostream>
+#include <map>
+#include <set>
 #include <list>
+#include <mutex>
+#include <memory>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdlib.h>
+#include <time.h>
 #include <sqlite3.h>
 #include <openssl/md5.h>
 
@@ -16,6 +27,29 @@
 
 enum classTypes { TYPE_ALBUM = 0, TYPE_ARTIST = 1, TYPE_SONG = 2, TYPE_ERROR = 3 };
 
+// Column lists matching the Album/Song constructors
+#define ALBUM_FIELDS "`id`, title, artistid, artist, hascover, year, genre, " \
+	"songcount, duration, created, sortkey "
+#define ARTIST_FIELDS "`id`, `name`, albumcount, created, indexletter "
+#define SONG_FIELDS "`id`, title, albumid, album, artistid, artist, " \
+	"trackn, discn, year, duration, bitRate, filesize, genre, type "
+
+// sqlite3_prepare_v2 that logs failures, ie. a database schema that lacks
+// columns the server uses (stepping the NULL statement then finds no rows)
+static int prepare_stmt(sqlite3 *db, const char *sql, int len, sqlite3_stmt **stmt,
+                        const char **tail) {
+	int rc = sqlite3_prepare_v2(db, sql, len, stmt, tail);
+	if (rc != SQLITE_OK)
+		std::cerr << "Query failed to prepare (" << sqlite3_errmsg(db) << "): " << sql << std::endl;
+	return rc;
+}
+
+// Text column that might be NULL (ie. not computed by an older scanner)
+static std::string column_str(sqlite3_stmt * stmt, int col) {
+	const char *r = (const char*)sqlite3_column_text(stmt, col);
+	return r ? r : "";
+}
+
 class IdObj {
 public:
 	std::string sid() const { return hexencode64(id); }
@@ -24,27 +58,71 @@ public:
 
 class Artist : public IdObj {
 public:
+	Artist() : albumcount(0), created(0) { id = 0; }
 	Artist(sqlite3_stmt * stmt) {
-		id       = sqlite3_column_int64 (stmt, 0);
-		name     = std::string((char*)sqlite3_column_text (stmt, 1));
+		id         = sqlite3_column_int64 (stmt, 0);
+		name       = std::string((char*)sqlite3_column_text (stmt, 1));
+		albumcount = sqlite3_column_int(stmt, 2);
+		created    = sqlite3_column_int64(stmt, 3);
+		index      = column_str(stmt, 4);
 	}
-	std::string name;
+
+	std::unordered_map<std::string, DataField> getAttrs() const {
+		return {
+			{"id",         DS(sid()) },
+			{"name",       DS(name) },
+			{"albumCount", DI(albumcount) },
+		};
+	}
+
+	std::string name, index;
+	unsigned albumcount;
+	uint64_t created;
 };
 
 class Album : public IdObj {
 public:
-	Album() {}
+	Album() : artistid(0), hascover(0), year(0), songcount(0), duration(0), created(0) { id = 0; }
 	Album(sqlite3_stmt * stmt) {
 		id       = sqlite3_column_int64 (stmt, 0);
 		title    = std::string((char*)sqlite3_column_text (stmt, 1));
 		artistid = sqlite3_column_int64 (stmt, 2);
 		artist   = std::string((char*)sqlite3_column_text (stmt, 3));
 		hascover = sqlite3_column_int(stmt, 4);
+		year     = sqlite3_column_int(stmt, 5);
+		genre    = column_str(stmt, 6);
+		songcount= sqlite3_column_int(stmt, 7);
+		duration = sqlite3_column_int(stmt, 8);
+		created  = sqlite3_column_int64(stmt, 9);
+		sortkey  = column_str(stmt, 10);
 	}
+
+	// Works both as a directory child and as an ID3 album entry
+	std::unordered_map<std::string, DataField> getAttrs() const {
+		return {
+			{"id",        DS(sid()) },
+			{"title",     DS(title) },
+			{"name",      DS(title) },
+			{"album",     DS(title) },
+			{"artist",    DS(artist) },
+			{"artistId",  DS(sartistid()) },
+			{"parent",    DS(sartistid()) },
+			{"isDir",     DB(true) },
+			{"year",      year ? DI(year) : DN() },
+			{"genre",     genre.empty() ? DN() : DS(genre) },
+			{"songCount", DI(songcount) },
+			{"duration",  DI(duration) },
+			{"created",   created ? DS(isotime(created)) : DN() },
+			{"coverArt",  hascover ? DS(sid()) : DN() },
+		};
+	}
+
 	uint64_t artistid;
 	std::string sartistid() const { return hexencode64(artistid); }
-	std::string title, artist;
+	std::string title, artist, genre, sortkey;
 	int hascover;
+	unsigned year, songcount, duration;
+	uint64_t created;
 };
 
 class Song : public IdObj {
@@ -69,8 +147,8 @@ public:
 		bitRate  = sqlite3_column_int(stmt,10);
 		filesize = sqlite3_column_int(stmt,11);
 
-		genre    = std::string((char*)sqlite3_column_text (stmt, 12));
-		type     = std::string((char*)sqlite3_column_text (stmt, 13));
+		genre    = column_str(stmt, 12);
+		type     = column_str(stmt, 13);
 	}
 
 	std::string sartistid() const { return hexencode64(artistid); }
@@ -103,11 +181,48 @@ public:
 
 class DataModel {
 public:
-	DataModel(sqlite3* sqldb) : sqldb(sqldb) { }
+	DataModel(sqlite3* sqldb) : sqldb(sqldb), versioncheck(0) { }
+
+	// The scanner creates and migrates the schema, the server opens the
+	// database read-only. Returns the tables/columns the server needs that
+	// are not there (ie. the library was last scanned by an older scanner).
+	std::vector<std::string> missingSchema() {
+		static const struct {
+			const char *table;
+			std::vector<std::string> columns;
+		} required[] = {
+			{"albums",      {"year", "genre", "created", "songcount", "duration",
+			                 "sortkey", "artistsortkey"}},
+			{"artists",     {"albumcount", "created", "sortkey", "indexletter"}},
+			{"songs",       {"seektable"}},
+			{"meta",        {"key", "value"}},
+			{"artists_fts", {"name"}},
+			{"albums_fts",  {"title", "artist"}},
+			{"songs_fts",   {"title", "album", "artist"}},
+		};
+		std::vector<std::string> missing;
+		for (const auto & t : required) {
+			std::set<std::string> cols;
+			sqlite3_stmt *stmt;
+			prepare_stmt(sqldb, ("PRAGMA table_info(`" + std::string(t.table) + "`)").c_str(),
+			             -1, &stmt, NULL);
+			while (sqlite3_step(stmt) == SQLITE_ROW)
+				cols.insert(column_str(stmt, 1));
+			sqlite3_finalize(stmt);
+
+			if (cols.empty())
+				missing.push_back(t.table);
+			else
+				for (const auto & c : t.columns)
+					if (!cols.count(c))
+						missing.push_back(std::string(t.table) + "." + c);
+		}
+		return missing;
+	}
 
 	bool checkCredentials(std::string user, std::string pass) {
 		sqlite3_stmt *stmt;
-		sqlite3_prepare_v2(sqldb, "SELECT * FROM users WHERE username=? AND password=?", -1, &stmt, NULL);
+		prepare_stmt(sqldb, "SELECT * FROM users WHERE username=? AND password=?", -1, &stmt, NULL);
 		sqlite3_bind_text(stmt, 1, user.c_str(), -1, NULL);
 		sqlite3_bind_text(stmt, 2, pass.c_str(), -1, NULL);
 		bool res = (sqlite3_step(stmt) == SQLITE_ROW);
@@ -120,7 +235,7 @@ public:
 			return false;
 
 		sqlite3_stmt *stmt;
-		sqlite3_prepare_v2(sqldb, "SELECT password FROM users WHERE username=?", -1, &stmt, NULL);
+		prepare_stmt(sqldb, "SELECT password FROM users WHERE username=?", -1, &stmt, NULL);
 		sqlite3_bind_text(stmt, 1, user.c_str(), -1, NULL);
 		if (sqlite3_step(stmt) == SQLITE_ROW) {
 			// Query pass and get MD5, compare
@@ -135,7 +250,9 @@ public:
 		return false;
 	}
 
-	std::string getAlbumCover(uint64_t id, unsigned size) {
+	// Returns the smallest cover at least "size" pixels big (or the biggest
+	// one available). With sizeonly the blob is not read, just its length.
+	std::string getAlbumCover(uint64_t id, unsigned size, uint64_t *sizeonly = nullptr) {
 		const std::vector<std::string> fields = {
 			"cover128", "cover256", "cover512", "cover1024", "cover"
 		};
@@ -145,54 +262,114 @@ public:
 		               (size >  128) ? 1:0;
 
 		std::string ret;
-		for (unsigned i = off; i < 5 && ret.empty(); i++) {
+		uint64_t length = 0;
+		for (unsigned i = off; i < 5 && !length; i++) {
 			sqlite3_stmt *stmt;
-			sqlite3_prepare_v2(sqldb, ("SELECT " + fields[i] +
+			std::string col = sizeonly ? "length(" + fields[i] + ")" : fields[i];
+			prepare_stmt(sqldb, ("SELECT " + col +
 			                           " FROM albums WHERE id=?").c_str(), -1, &stmt, NULL);
 			sqlite3_bind_int64(stmt, 1, id);
 			if (sqlite3_step(stmt) == SQLITE_ROW) {
-				auto length = sqlite3_column_bytes(stmt, 0);
-				ret = std::string((char*)sqlite3_column_blob(stmt, 0), length);
+				if (sizeonly)
+					length = sqlite3_column_int64(stmt, 0);
+				else {
+					length = sqlite3_column_bytes(stmt, 0);
+					ret = std::string((char*)sqlite3_column_blob(stmt, 0), length);
+				}
 			}
 			sqlite3_finalize(stmt);
 		}
+		if (sizeonly)
+			*sizeonly = length;
 		return ret;
 	}
 
-	std::string getSongFile(uint64_t id) {
+	// Returns the song file name, and its size and mtime as recorded by the scanner
+	std::string getSongFile(uint64_t id, uint64_t *filesize = nullptr, uint64_t *mtime = nullptr) {
 		std::string filename;
 		sqlite3_stmt *stmt;
-		sqlite3_prepare_v2(sqldb, "SELECT filename FROM songs WHERE id=?", -1, &stmt, NULL);
+		prepare_stmt(sqldb, "SELECT filename, filesize, timestamp FROM songs WHERE id=?",
+		                   -1, &stmt, NULL);
 		sqlite3_bind_int64(stmt, 1, id);
 		if (sqlite3_step(stmt) == SQLITE_ROW) {
 			filename = (char*)sqlite3_column_text (stmt, 0);
+			if (filesize)
+				*filesize = sqlite3_column_int64(stmt, 1);
+			if (mtime)
+				*mtime = sqlite3_column_int64(stmt, 2);
 		}
 		sqlite3_finalize(stmt);
 
 		return filename;
 	}
 
+	// Translates a playback time into a byte offset to stream a song from,
+	// using the seek table built by the scanner. Returns 0 if not possible.
+	// "prefix" is set to the number of header bytes that must precede it.
+	uint64_t getSongSeekOffset(uint64_t id, uint64_t ms, uint64_t *prefix) {
+		uint64_t offset = 0;
+		*prefix = 0;
+		sqlite3_stmt *stmt;
+		prepare_stmt(sqldb, "SELECT seektable, type, filesize, duration FROM songs WHERE id=?",
+		                   -1, &stmt, NULL);
+		sqlite3_bind_int64(stmt, 1, id);
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			auto length = sqlite3_column_bytes(stmt, 0);
+			if (length)
+				offset = seektable_lookup(std::string((char*)sqlite3_column_blob(stmt, 0), length),
+				                          ms, prefix);
+			else if (column_str(stmt, 1) == "mp3" && sqlite3_column_int64(stmt, 3)) {
+				// Songs scanned before seek tables existed: assume CBR,
+				// decoders resync to the next frame anyway.
+				uint64_t duration = sqlite3_column_int64(stmt, 3) * 1000;
+				if (ms < duration)
+					offset = sqlite3_column_int64(stmt, 2) * ms / duration;
+			}
+		}
+		sqlite3_finalize(stmt);
+		return offset;
+	}
+
 	std::list<Album> getAllAlbumsSorted(unsigned offset, unsigned size) {
+		// Use the keyset cursor left by the previous page if any, this way we
+		// seek the title index instead of skipping "offset" rows.
+		AlbumCursor cur;
 		sqlite3_stmt *stmt;
-		sqlite3_prepare_v2(sqldb, "SELECT `id`, title, artistid, artist, hascover "
-		                          "FROM albums ORDER BY `title` COLLATE NOCASE ASC "
-		                          "LIMIT ? OFFSET ?", -1, &stmt, NULL);
-		sqlite3_bind_int64(stmt, 1, size);
-		sqlite3_bind_int64(stmt, 2, offset);
+		int64_t version = dataVersion();
+		if (getCursor(offset, version, &cur)) {
+			prepare_stmt(sqldb, "SELECT " ALBUM_FIELDS
+			                          "FROM albums WHERE `sortkey` >= ?1 AND "
+			                          "(`sortkey`, `id`) > (?1, ?2) "
+			                          "ORDER BY `sortkey` ASC, `id` ASC "
+			                          "LIMIT ?3", -1, &stmt, NULL);
+			sqlite3_bind_text (stmt, 1, cur.sortkey.c_str(), -1, SQLITE_TRANSIENT);
+			sqlite3_bind_int64(stmt, 2, cur.id);
+			sqlite3_bind_int64(stmt, 3, size);
+		}
+		else {
+			prepare_stmt(sqldb, "SELECT " ALBUM_FIELDS
+			                          "FROM albums ORDER BY `sortkey` ASC, `id` ASC "
+			                          "LIMIT ? OFFSET ?", -1, &stmt, NULL);
+			sqlite3_bind_int64(stmt, 1, size);
+			sqlite3_bind_int64(stmt, 2, offset);
+		}
 
 		std::list<Album> albums;
 		while (sqlite3_step(stmt) == SQLITE_ROW)
 			albums.emplace_back(stmt);
 		sqlite3_finalize(stmt);
 
+		if (size && albums.size() == size)
+			putCursor(offset + size, version, {albums.back().sortkey, albums.back().id});
+
 		return albums;
 	}
 
 	std::list<Album> getAlbumsByArtist(uint64_t artistid) {
 		sqlite3_stmt *stmt;
-		sqlite3_prepare_v2(sqldb, "SELECT `id`, title, artistid, artist, hascover "
-		                          "FROM albums WHERE artistid=? ORDER BY `title` "
-		                          "COLLATE NOCASE ASC", -1, &stmt, NULL);
+		prepare_stmt(sqldb, "SELECT " ALBUM_FIELDS
+		                          "FROM albums WHERE artistid=? ORDER BY `sortkey` ASC",
+		                          -1, &stmt, NULL);
 		sqlite3_bind_int64(stmt, 1, artistid);
 
 		std::list<Album> albums;
@@ -205,7 +382,7 @@ public:
 
 	Album getAlbum(uint64_t id) {
 		sqlite3_stmt *stmt;
-		sqlite3_prepare_v2(sqldb, "SELECT `id`, title, artistid, artist, hascover "
+		prepare_stmt(sqldb, "SELECT " ALBUM_FIELDS
 		                          "FROM albums WHERE `id`=?", -1, &stmt, NULL);
 		sqlite3_bind_int64(stmt, 1, id);
 
@@ -217,9 +394,134 @@ public:
 		return ret;
 	}
 
+	// Fetches several albums by id, in the same order as given (missing ones are skipped)
+	std::list<Album> getAlbums(const std::vector<uint64_t> &ids) {
+		return getByIds<Album>("SELECT " ALBUM_FIELDS "FROM albums", ids);
+	}
+
+	std::list<Album> getAlbumsNewest(unsigned offset, unsigned size) {
+		sqlite3_stmt *stmt;
+		prepare_stmt(sqldb, "SELECT " ALBUM_FIELDS "FROM albums "
+		                          "ORDER BY `created` DESC LIMIT ? OFFSET ?", -1, &stmt, NULL);
+		sqlite3_bind_int64(stmt, 1, size);
+		sqlite3_bind_int64(stmt, 2, offset);
+		return stepAlbums(stmt);
+	}
+
+	std::list<Album> getAlbumsSortedByArtist(unsigned offset, unsigned size) {
+		sqlite3_stmt *stmt;
+		prepare_stmt(sqldb, "SELECT " ALBUM_FIELDS "FROM albums "
+		                          "ORDER BY `artistsortkey` ASC, `sortkey` ASC "
+		                          "LIMIT ? OFFSET ?", -1, &stmt, NULL);
+		sqlite3_bind_int64(stmt, 1, size);
+		sqlite3_bind_int64(stmt, 2, offset);
+		return stepAlbums(stmt);
+	}
+
+	// Albums in a year range, in descending order if fromyear > toyear
+	std::list<Album> getAlbumsByYear(unsigned fromyear, unsigned toyear,
+	                                 unsigned offset, unsigned size) {
+		sqlite3_stmt *stmt;
+		prepare_stmt(sqldb, fromyear <= toyear ?
+		                   "SELECT " ALBUM_FIELDS "FROM albums WHERE `year` BETWEEN ? AND ? "
+		                   "ORDER BY `year` ASC LIMIT ? OFFSET ?" :
+		                   "SELECT " ALBUM_FIELDS "FROM albums WHERE `year` BETWEEN ? AND ? "
+		                   "ORDER BY `year` DESC LIMIT ? OFFSET ?", -1, &stmt, NULL);
+		sqlite3_bind_int64(stmt, 1, std::min(fromyear, toyear));
+		sqlite3_bind_int64(stmt, 2, std::max(fromyear, toyear));
+		sqlite3_bind_int64(stmt, 3, size);
+		sqlite3_bind_int64(stmt, 4, offset);
+		return stepAlbums(stmt);
+	}
+
+	std::list<Album> getAlbumsByGenre(std::string genre, unsigned offset, unsigned size) {
+		sqlite3_stmt *stmt;
+		prepare_stmt(sqldb, "SELECT " ALBUM_FIELDS "FROM albums WHERE `genre` = ? "
+		                          "LIMIT ? OFFSET ?", -1, &stmt, NULL);
+		sqlite3_bind_text (stmt, 1, genre.c_str(), -1, SQLITE_TRANSIENT);
+		sqlite3_bind_int64(stmt, 2, size);
+		sqlite3_bind_int64(stmt, 3, offset);
+		return stepAlbums(stmt);
+	}
+
+	// Album IDs are (truncated) hashes, so they are uniformly spread: picking the
+	// first album after a random ID is a cheap rowid seek, no table scans.
+	std::list<Album> getRandomAlbums(unsigned size) {
+		// Album ids are few and cheap to list, sampling positions in that list
+		// is uniform (unlike probing random ids, which favours albums after gaps)
+		std::vector<uint64_t> all;
+		sqlite3_stmt *stmt;
+		prepare_stmt(sqldb, "SELECT `id` FROM albums", -1, &stmt, NULL);
+		while (sqlite3_step(stmt) == SQLITE_ROW)
+			all.push_back(sqlite3_column_int64(stmt, 0));
+		sqlite3_finalize(stmt);
+
+		static thread_local std::mt19937_64 rng(std::random_device{}());
+		if (size >= all.size()) {
+			std::shuffle(all.begin(), all.end(), rng);
+			return getAlbums(all);
+		}
+
+		// Draw again on repeats until there are size distinct albums
+		std::vector<uint64_t> ids;
+		std::unordered_set<size_t> picked;
+		std::uniform_int_distribution<size_t> dist(0, all.size() - 1);
+		while (ids.size() < size) {
+			size_t t = dist(rng);
+			if (picked.insert(t).second)
+				ids.push_back(all[t]);
+		}
+		return getAlbums(ids);
+	}
+
+	// Library generation and modification time (ms since epoch) as set by the
+	// scanner, 0 if unknown. Cached for a second, so that conditional requests
+	// can be answered without hitting the database.
+	struct LibraryVersion {
+		uint64_t generation, lastmodified;
+	};
+
+	LibraryVersion getLibraryVersion() {
+		time_t now = time(NULL);
+		std::lock_guard<std::mutex> g(versionmutex);
+		if (now == versioncheck)
+			return version;
+
+		sqlite3_stmt *stmt;
+		prepare_stmt(sqldb, "SELECT `key`, `value` FROM meta WHERE `key` IN "
+		                   "('generation', 'lastmodified')", -1, &stmt, NULL);
+		version = {0, 0};
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			if (column_str(stmt, 0) == "generation")
+				version.generation = sqlite3_column_int64(stmt, 1);
+			else
+				version.lastmodified = sqlite3_column_int64(stmt, 1);
+		}
+		sqlite3_finalize(stmt);
+		versioncheck = now;
+		return version;
+	}
+
+	uint64_t getLastModified() {
+		return getLibraryVersion().lastmodified;
+	}
+
+	Artist getArtist(uint64_t id) {
+		sqlite3_stmt *stmt;
+		prepare_stmt(sqldb, "SELECT " ARTIST_FIELDS "FROM artists WHERE `id`=?", -1, &stmt, NULL);
+		sqlite3_bind_int64(stmt, 1, id);
+
+		Artist ret;
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			ret = Artist(stmt);
+		sqlite3_finalize(stmt);
+
+		return ret;
+	}
+
 	std::list<Artist> getArtists() {
 		sqlite3_stmt *stmt;
-		sqlite3_prepare_v2(sqldb, "SELECT `id`, `name` FROM artists ORDER BY `name` COLLATE NOCASE ASC", -1, &stmt, NULL);
+		prepare_stmt(sqldb, "SELECT " ARTIST_FIELDS "FROM artists ORDER BY `sortkey` ASC", -1, &stmt, NULL);
 
 		std::list<Artist> artists;
 		while (sqlite3_step(stmt) == SQLITE_ROW)
@@ -229,10 +531,55 @@ public:
 		return artists;
 	}
 
+	// Full text search (prefix match on every word) over the scanner built FTS
+	// indexes. An empty query lists everything, some clients sync that way.
+	std::list<Artist> searchArtists(std::string query, unsigned offset, unsigned count) {
+		sqlite3_stmt *stmt;
+		prepareSearch(&stmt, ARTIST_FIELDS "FROM artists", "artists_fts", query, offset, count);
+		std::list<Artist> artists;
+		while (sqlite3_step(stmt) == SQLITE_ROW)
+			artists.emplace_back(stmt);
+		sqlite3_finalize(stmt);
+		return artists;
+	}
+
+	std::list<Album> searchAlbums(std::string query, unsigned offset, unsigned count) {
+		sqlite3_stmt *stmt;
+		prepareSearch(&stmt, ALBUM_FIELDS "FROM albums", "albums_fts", query, offset, count);
+		return stepAlbums(stmt);
+	}
+
+	std::list<Song> searchSongs(std::string query, unsigned offset, unsigned count) {
+		sqlite3_stmt *stmt;
+		prepareSearch(&stmt, SONG_FIELDS "FROM songs", "songs_fts", query, offset, count);
+		std::list<Song> songs;
+		while (sqlite3_step(stmt) == SQLITE_ROW)
+			songs.emplace_back(stmt);
+		sqlite3_finalize(stmt);
+		return songs;
+	}
+
+	// Number of songs matching a search (all of them for an empty query)
+	uint64_t countSearchSongs(std::string query) {
+		sqlite3_stmt *stmt;
+		std::string match = ftsQuery(query);
+		if (match.empty())
+			prepare_stmt(sqldb, "SELECT COUNT(*) FROM songs", -1, &stmt, NULL);
+		else {
+			prepare_stmt(sqldb, "SELECT COUNT(*) FROM songs_fts WHERE songs_fts MATCH ?",
+			                   -1, &stmt, NULL);
+			sqlite3_bind_text(stmt, 1, match.c_str(), -1, SQLITE_TRANSIENT);
+		}
+		uint64_t ret = 0;
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			ret = sqlite3_column_int64(stmt, 0);
+		sqlite3_finalize(stmt);
+		return ret;
+	}
+
 	std::unique_ptr<Song> getSong(uint64_t id) {
 		sqlite3_stmt *stmt;
-		sqlite3_prepare_v2(sqldb, "SELECT `id`, title, albumid, album, artistid, artist,"
-			"trackn, discn, year, duration, bitRate, filesize, genre, type FROM songs "
+		prepare_stmt(sqldb, "SELECT " SONG_FIELDS "FROM songs "
 			"WHERE `id`=?", -1, &stmt, NULL);
 		sqlite3_bind_int64(stmt, 1, id);
 
@@ -244,10 +591,14 @@ public:
 		return std::unique_ptr<Song>(ret);
 	}
 
+	// Same for songs, ids can be repeated (ie. playlists)
+	std::list<Song> getSongs(const std::vector<uint64_t> &ids) {
+		return getByIds<Song>("SELECT " SONG_FIELDS "FROM songs", ids);
+	}
+
 	std::list<Song> getSongsByAlbum(uint64_t id) {
 		sqlite3_stmt *stmt;
-		sqlite3_prepare_v2(sqldb, "SELECT `id`, title, albumid, album, artistid, artist,"
-			"trackn, discn, year, duration, bitRate, filesize, genre, type FROM songs "
+		prepare_stmt(sqldb, "SELECT " SONG_FIELDS "FROM songs "
 			"WHERE `albumid`=? ORDER BY trackn, discn ASC", -1, &stmt, NULL);
 
 		sqlite3_bind_int64(stmt, 1, id);
@@ -260,19 +611,48 @@ public:
 		return songs;
 	}
 
-	std::list<Song> getRandomSongs(unsigned limit) {
-		sqlite3_stmt *stmt;
-		sqlite3_prepare_v2(sqldb, "SELECT `id`, title, albumid, album, artistid, artist, "
-			"trackn, discn, year, duration, bitRate, filesize, genre, type FROM songs "
-			"ORDER BY random() LIMIT ?", -1, &stmt, NULL);
-		sqlite3_bind_int64(stmt, 1, limit);
+	// Random sample of songs, optionally filtered by genre and year range (0 means
+	// no bound). Samples over the in-memory song index, so it costs O(limit).
+	std::list<Song> getRandomSongs(unsigned limit, std::string genre = "",
+	                               unsigned fromyear = 0, unsigned toyear = 0) {
+		auto idx = getSongIndex();
+		const YearSortedIds *src = &idx->all;
+		if (!genre.empty()) {
+			auto it = idx->bygenre.find(genre);
+			if (it == idx->bygenre.end())
+				return {};
+			src = &it->second;
+		}
 
-		std::list<Song> songs;
-		while (sqlite3_step(stmt) == SQLITE_ROW)
-			songs.emplace_back(stmt);
-		sqlite3_finalize(stmt);
+		// Reversed bounds are taken as the same range (like getAlbumsByYear)
+		if (toyear && fromyear > toyear)
+			std::swap(fromyear, toyear);
+
+		// Songs are sorted by year, so the range is a contiguous slice
+		size_t lo = std::lower_bound(src->years.begin(), src->years.end(), fromyear) - src->years.begin();
+		size_t hi = toyear ? std::upper_bound(src->years.begin(), src->years.end(), toyear) - src->years.begin()
+		                   : src->years.size();
+		if (lo >= hi)
+			return {};
+
+		// Floyd's algorithm: picks min(limit, n) distinct positions in O(limit)
+		static thread_local std::mt19937_64 rng(std::random_device{}());
+		size_t n = hi - lo, k = std::min((size_t)limit, n);
+		std::vector<size_t> picks;
+		std::unordered_set<size_t> picked;
+		for (size_t j = n - k; j < n; j++) {
+			size_t t = std::uniform_int_distribution<size_t>(0, j)(rng);
+			if (picked.count(t))
+				t = j;
+			picked.insert(t);
+			picks.push_back(t);
+		}
+		std::shuffle(picks.begin(), picks.end(), rng);
 
-		return songs;
+		std::vector<uint64_t> ids;
+		for (auto p : picks)
+			ids.push_back(src->ids[lo + p]);
+		return getSongs(ids);
 	}
 
 	classTypes classifyId(uint64_t id) {
@@ -284,6 +664,172 @@ public:
 
 private:
 	sqlite3 * sqldb;
+
+	LibraryVersion version;
+	time_t versioncheck;
+	std::mutex versionmutex;
+
+	// Dense in-memory list of song ids (sorted by year) used for sampling, with
+	// per genre lists. Rebuilt whenever the database changes (data_version).
+	struct YearSortedIds {
+		std::vector<uint64_t> ids;
+		std::vector<unsigned> years;
+	};
+	struct SongIndex {
+		int64_t version;
+		YearSortedIds all;
+		std::unordered_map<std::string, YearSortedIds> bygenre;
+	};
+	std::shared_ptr<const SongIndex> songidx;
+	std::mutex songidxmutex;
+
+	int64_t dataVersion() {
+		sqlite3_stmt *stmt;
+		prepare_stmt(sqldb, "PRAGMA data_version", -1, &stmt, NULL);
+		int64_t ret = -1;
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			ret = sqlite3_column_int64(stmt, 0);
+		sqlite3_finalize(stmt);
+		return ret;
+	}
+
+	std::shared_ptr<const SongIndex> getSongIndex() {
+		int64_t version = dataVersion();
+		std::lock_guard<std::mutex> g(songidxmutex);
+		if (songidx && songidx->version == version)
+			return songidx;
+
+		std::shared_ptr<SongIndex> idx(new SongIndex());
+		idx->version = version;
+		sqlite3_stmt *stmt;
+		prepare_stmt(sqldb, "SELECT `id`, genre, year FROM songs ORDER BY year ASC",
+		                   -1, &stmt, NULL);
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			uint64_t id = sqlite3_column_int64(stmt, 0);
+			unsigned year = sqlite3_column_int(stmt, 2);
+			auto & gl = idx->bygenre[column_str(stmt, 1)];
+			for (auto l : {&idx->all, &gl}) {
+				l->ids.push_back(id);
+				l->years.push_back(year);
+			}
+		}
+		sqlite3_finalize(stmt);
+
+		songidx = idx;
+		return songidx;
+	}
+
+	// Turns user input into an FTS5 query: every word is quoted and prefix matched
+	static std::string ftsQuery(const std::string &q) {
+		std::string ret, word;
+		for (unsigned i = 0; i <= q.size(); i++) {
+			char c = i < q.size() ? q[i] : ' ';
+			if (c == ' ' || c == '\t' || c == '*') {
+				if (!word.empty())
+					ret += (ret.empty() ? "\"" : " \"") + word + "\"*";
+				word.clear();
+			}
+			else if (c == '"')
+				word += "\"\"";
+			else
+				word.push_back(c);
+		}
+		return ret;
+	}
+
+	void prepareSearch(sqlite3_stmt **stmt, std::string fields_table, std::string fts,
+	                   const std::string &query, unsigned offset, unsigned count) {
+		std::string match = ftsQuery(query);
+		if (match.empty()) {
+			prepare_stmt(sqldb, ("SELECT " + fields_table +
+			                   " ORDER BY `id` LIMIT ?2 OFFSET ?3").c_str(), -1, stmt, NULL);
+		}
+		else {
+			prepare_stmt(sqldb, ("SELECT " + fields_table + " JOIN "
+			                   "(SELECT rowid AS ftsid, rank AS ftsrank FROM " + fts +
+			                   " WHERE " + fts + " MATCH ?1 ORDER BY rank LIMIT ?2 OFFSET ?3) "
+			                   "ON `id` = ftsid ORDER BY ftsrank").c_str(), -1, stmt, NULL);
+			sqlite3_bind_text(*stmt, 1, match.c_str(), -1, SQLITE_TRANSIENT);
+		}
+		sqlite3_bind_int64(*stmt, 2, count);
+		sqlite3_bind_int64(*stmt, 3, offset);
+	}
+
+	// Resolves a list of ids using IN (...) queries in chunks, so we do a few
+	// queries instead of one per id. Results follow the order of ids.
+	template<typename T>
+	std::list<T> getByIds(const char *select, const std::vector<uint64_t> &ids) {
+		const unsigned chunksize = 256;
+		std::unordered_map<uint64_t, T> found;
+		for (unsigned off = 0; off < ids.size(); off += chunksize) {
+			unsigned n = std::min((size_t)chunksize, ids.size() - off);
+			std::string qs(n * 2 - 1, ',');
+			for (unsigned i = 0; i < n; i++)
+				qs[i*2] = '?';
+
+			sqlite3_stmt *stmt;
+			prepare_stmt(sqldb, (std::string(select) + " WHERE `id` IN (" +
+			                   qs + ")").c_str(), -1, &stmt, NULL);
+			for (unsigned i = 0; i < n; i++)
+				sqlite3_bind_int64(stmt, i + 1, ids[off + i]);
+			while (sqlite3_step(stmt) == SQLITE_ROW) {
+				uint64_t id = sqlite3_column_int64(stmt, 0);
+				found.emplace(id, T(stmt));
+			}
+			sqlite3_finalize(stmt);
+		}
+
+		std::list<T> ret;
+		for (auto id : ids) {
+			auto it = found.find(id);
+			if (it != found.end())
+				ret.push_back(it->second);
+		}
+		return ret;
+	}
+
+	std::list<Album> stepAlbums(sqlite3_stmt *stmt) {
+		std::list<Album> albums;
+		while (sqlite3_step(stmt) == SQLITE_ROW)
+			albums.emplace_back(stmt);
+		sqlite3_finalize(stmt);
+		return albums;
+	}
+
+	// Keyset pagination cursors for the sorted album list, indexed by the
+	// offset they resume at. Clients page sequentially so this hits mostly.
+	// They are dropped whenever the database changes (data_version), since
+	// offsets no longer point at the same albums then.
+	struct AlbumCursor {
+		std::string sortkey;
+		uint64_t id;
+	};
+	std::map<unsigned, AlbumCursor> cursors;
+	int64_t cursorversion = -1;
+	std::mutex cursormutex;
+	const unsigned max_cursors = 1024;
+
+	bool getCursor(unsigned offset, int64_t version, AlbumCursor *cur) {
+		std::lock_guard<std::mutex> g(cursormutex);
+		if (version != cursorversion) {
+			cursors.clear();
+			cursorversion = version;
+		}
+		auto it = cursors.find(offset);
+		if (!offset || it == cursors.end())
+			return false;
+		*cur = it->second;
+		return true;
+	}
+
+	void putCursor(unsigned offset, int64_t version, AlbumCursor cur) {
+		std::lock_guard<std::mutex> g(cursormutex);
+		if (version != cursorversion)
+			return;   // The database changed during the query
+		if (cursors.size() >= max_cursors)
+			cursors.clear();
+		cursors[offset] = cur;
+	}
 };
 
 #endif
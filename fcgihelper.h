@@ -3,6 +3,7 @@
 #define __FCGI_HLPR__H__
 
 #include <string>
+#include <stdint.h>
 
 // FastCGI responder helpers
 // Provides a simple responder for head/body and some ready to use responses
@@ -13,6 +14,9 @@ public:
 	virtual ~fcgi_responder() {}
 	virtual std::string header() = 0;
 	virtual std::string respond() = 0;
+	// Nanoseconds to wait before calling respond() again (ie. rate limited
+	// streams), the caller can serve something else meanwhile.
+	virtual uint64_t wait() { return 0; }
 };
 
 class str_resp : public fcgi_responder {
@@ -45,6 +49,18 @@ static str_resp *respond_method_not_allowed() {
 		"Content-Length: 18\r\n", "Method not allowed");
 }
 
+static str_resp *respond_too_many_requests() {
+	return new str_resp(
+		"Status: 429\r\n"
+		"Retry-After: 1\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: 17\r\n", "Too many requests");
+}
+
+static str_resp *respond_not_modified() {
+	return new str_resp("Status: 304\r\n", "");
+}
+
 #endif
 
 
@@ -0,0 +1,191 @@
+#ifndef _FILECACHE__H__
+#define _FILECACHE__H__
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <atomic>
+
+// An open song file, shared by all the responders streaming it (reads use
+// pread so there is no shared file position). Closed when the last user goes.
+class OpenFile {
+public:
+	OpenFile(int fd, const struct stat &st)
+	  : fd(fd), size(st.st_size), mtime(st.st_mtime), dev(st.st_dev), ino(st.st_ino) {}
+	~OpenFile() { close(fd); }
+
+	const int fd;
+	const uint64_t size;
+	const time_t mtime;
+	const uint64_t dev, ino;   // Identify the file contents along with mtime
+};
+
+// Caches song id -> resolved absolute path, and keeps an LRU of open files.
+// Everything is tagged with the library generation and dropped when it changes.
+class FileCache {
+public:
+	FileCache(unsigned maxfiles, unsigned maxpaths)
+	  : maxfiles(maxfiles), maxpaths(maxpaths), generation(0) {}
+
+	// Returns the cached open file, or null (and the resolved path if known)
+	std::shared_ptr<OpenFile> get(uint64_t id, uint64_t gen, std::string *path) {
+		std::lock_guard<std::mutex> g(mu);
+		checkGeneration(gen);
+		auto it = files.find(id);
+		if (it != files.end()) {
+			// Move to the front, most recently used
+			lru.splice(lru.begin(), lru, it->second);
+			return it->second->second;
+		}
+		auto pit = paths.find(id);
+		if (pit != paths.end())
+			*path = pit->second;
+		return nullptr;
+	}
+
+	void put(uint64_t id, uint64_t gen, const std::string &path, std::shared_ptr<OpenFile> file) {
+		std::lock_guard<std::mutex> g(mu);
+		checkGeneration(gen);
+		if (paths.size() >= maxpaths)
+			paths.clear();
+		paths[id] = path;
+
+		if (files.count(id) || !maxfiles)
+			return;
+		lru.emplace_front(id, file);
+		files[id] = lru.begin();
+		if (lru.size() > maxfiles) {
+			files.erase(lru.back().first);
+			lru.pop_back();
+		}
+	}
+
+private:
+	void checkGeneration(uint64_t gen) {
+		if (gen != generation) {
+			generation = gen;
+			files.clear();
+			lru.clear();
+			paths.clear();
+		}
+	}
+
+	typedef std::list<std::pair<uint64_t, std::shared_ptr<OpenFile>>> file_list;
+
+	const unsigned maxfiles, maxpaths;
+	std::mutex mu;
+	uint64_t generation;
+	file_list lru;
+	std::unordered_map<uint64_t, file_list::iterator> files;
+	std::unordered_map<uint64_t, std::string> paths;
+};
+
+// Shared cache of file blocks, so songs played by several listeners at once
+// are read from disk once. Blocks are fixed size and aligned, keyed by file
+// (device, inode, mtime) and block number. It is split in independently
+// locked shards, each one an LRU with its share of the memory budget.
+// Blocks are refcounted so eviction does not affect readers using them.
+class ChunkCache {
+public:
+	static const unsigned block_size = 128*1024;
+	static const unsigned nshards = 16;
+	// Smallest useful budget, one block per shard
+	static const uint64_t min_bytes = (uint64_t)block_size * nshards;
+	typedef std::shared_ptr<const std::string> Block;
+
+	ChunkCache(uint64_t maxbytes) : shardbytes(maxbytes / nshards), hits(0), misses(0) {}
+
+	bool enabled() const { return shardbytes >= block_size; }
+
+	// Returns the block (shorter than block_size at EOF, empty on error)
+	// If the cache is disabled the block is just read from the file.
+	Block read(const OpenFile &f, uint64_t blockn) {
+		if (!enabled())
+			return readFile(f, blockn);
+
+		BlockKey key = {f.dev, f.ino, (uint64_t)f.mtime, blockn};
+		Shard &shard = shards[BlockKeyHash()(key) % nshards];
+		{
+			std::lock_guard<std::mutex> g(shard.mu);
+			auto it = shard.blocks.find(key);
+			if (it != shard.blocks.end()) {
+				shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+				hits++;
+				return it->second->second;
+			}
+		}
+		misses++;
+
+		// Read without holding the lock, concurrent misses might read twice
+		Block blk = readFile(f, blockn);
+		if (blk->empty())
+			return blk;
+
+		std::lock_guard<std::mutex> g(shard.mu);
+		if (shard.blocks.count(key))
+			return blk;
+		shard.lru.emplace_front(key, blk);
+		shard.blocks[key] = shard.lru.begin();
+		shard.bytes += blk->size();
+		while (shard.bytes > shardbytes) {
+			shard.bytes -= shard.lru.back().second->size();
+			shard.blocks.erase(shard.lru.back().first);
+			shard.lru.pop_back();
+		}
+		return blk;
+	}
+
+	// Human readable hit/miss stats
+	std::string stats() const {
+		uint64_t h = hits, m = misses;
+		return "chunk cache: " + std::to_string(h) + " hits, " + std::to_string(m) +
+		       " misses (" + std::to_string(h + m ? h * 100 / (h + m) : 0) + "% hit rate)";
+	}
+
+private:
+	static Block readFile(const OpenFile &f, uint64_t blockn) {
+		std::string data(block_size, 0);
+		ssize_t r = pread(f.fd, &data[0], block_size, blockn * block_size);
+		data.resize(r > 0 ? r : 0);
+		return std::make_shared<const std::string>(std::move(data));
+	}
+
+	struct BlockKey {
+		uint64_t dev, ino, mtime, blockn;
+		bool operator==(const BlockKey &o) const {
+			return dev == o.dev && ino == o.ino && mtime == o.mtime && blockn == o.blockn;
+		}
+	};
+	struct BlockKeyHash {
+		size_t operator()(const BlockKey &k) const {
+			uint64_t h = k.ino * 0x9E3779B97F4A7C15ULL;
+			h ^= k.dev + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+			h ^= k.mtime + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+			h ^= k.blockn + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+			return h;
+		}
+	};
+	typedef std::list<std::pair<BlockKey, Block>> block_list;
+
+	struct Shard {
+		Shard() : bytes(0) {}
+		std::mutex mu;
+		block_list lru;
+		std::unordered_map<BlockKey, block_list::iterator, BlockKeyHash> blocks;
+		uint64_t bytes;
+	};
+
+	const uint64_t shardbytes;
+	Shard shards[nshards];
+	std::atomic<uint64_t> hits, misses;
+};
+
+#endif
+
@@ -0,0 +1,63 @@
+#ifndef _IOPOOL__H__
+#define _IOPOOL__H__
+
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "queue.h"
+#include "filecache.h"
+
+// Pool of I/O threads that read file blocks (through the chunk cache) on
+// behalf of the stream responders. Responders ask for the block that follows
+// the one they are sending, so disk reads overlap with socket writes and a
+// slow disk stalls an I/O thread instead of the worker. Without threads reads
+// are deferred and happen synchronously when the block is needed.
+class IOPool {
+public:
+	typedef ChunkCache::Block Block;
+
+	IOPool(ChunkCache *chunks, unsigned nthreads) : chunks(chunks) {
+		for (unsigned i = 0; i < nthreads; i++)
+			threads.emplace_back(&IOPool::work, this);
+	}
+
+	~IOPool() {
+		tasks.close();
+		for (auto & t : threads)
+			t.join();
+	}
+
+	// Reads a block right away
+	Block read(const OpenFile &f, uint64_t blockn) {
+		return chunks->read(f, blockn);
+	}
+
+	// Schedules a block read, the task keeps the file open until done
+	std::future<Block> readAhead(std::shared_ptr<OpenFile> f, uint64_t blockn) {
+		ChunkCache *c = chunks;
+		auto fn = [c, f, blockn] () { return c->read(*f, blockn); };
+		if (threads.empty())
+			return std::async(std::launch::deferred, fn);
+
+		std::packaged_task<Block()> task(fn);
+		auto ret = task.get_future();
+		tasks.push(std::move(task));
+		return ret;
+	}
+
+private:
+	void work() {
+		std::packaged_task<Block()> task;
+		while (tasks.pop(&task))
+			task();
+	}
+
+	ChunkCache *chunks;
+	ConcurrentQueue<std::packaged_task<Block()>> tasks;
+	std::vector<std::thread> threads;
+};
+
+#endif
+
@@ -0,0 +1,130 @@
+#ifndef _PREFETCH__H__
+#define _PREFETCH__H__
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <fcntl.h>
+
+#include "queue.h"
+#include "datamodel.h"
+#include "filecache.h"
+
+// Predicts the next song a user will play (next playlist entry if the song
+// belongs to the last playlist they fetched, else the next album track) and
+// warms it up in a background thread: the file is opened (and kept in the
+// file cache), the kernel is asked to read it ahead and its first block is
+// loaded in the chunk cache.
+class Prefetcher {
+public:
+	typedef std::function<std::shared_ptr<OpenFile>(uint64_t)> opener_fn;
+
+	Prefetcher(DataModel *model, ChunkCache *chunks, opener_fn opener, bool enabled)
+	  : model(model), chunks(chunks), opener(opener), enabled(enabled), hits(0), misses(0) {
+		if (enabled)
+			pthread = std::thread(&Prefetcher::work, this);
+	}
+
+	~Prefetcher() {
+		jobs.close();
+		if (pthread.joinable())
+			pthread.join();
+	}
+
+	// Records the last playlist a user fetched, it's likely to be played
+	void setPlaylist(const std::string &user, const std::vector<uint64_t> &songs) {
+		if (!enabled)
+			return;
+		std::lock_guard<std::mutex> g(mu);
+		users[user].playlist = songs;
+	}
+
+	// A user started playing a song, check the previous guess and guess again
+	void played(const std::string &user, uint64_t songid) {
+		if (!enabled)
+			return;
+		std::vector<uint64_t> playlist;
+		{
+			std::lock_guard<std::mutex> g(mu);
+			UserContext &ctx = users[user];
+			if (ctx.predicted)
+				(ctx.predicted == songid ? hits : misses)++;
+			ctx.predicted = 0;
+			playlist = ctx.playlist;
+		}
+		jobs.push(Job{user, songid, std::move(playlist)});
+	}
+
+	std::string stats() const {
+		uint64_t h = hits, m = misses;
+		return "prefetch: " + std::to_string(h) + " hits, " + std::to_string(m) + " misses";
+	}
+
+private:
+	struct UserContext {
+		UserContext() : predicted(0) {}
+		std::vector<uint64_t> playlist;
+		uint64_t predicted;
+	};
+	struct Job {
+		std::string user;
+		uint64_t songid;
+		std::vector<uint64_t> playlist;
+	};
+
+	void work() {
+		Job job;
+		while (jobs.pop(&job)) {
+			uint64_t next = predict(job);
+			if (!next)
+				continue;
+			{
+				std::lock_guard<std::mutex> g(mu);
+				users[job.user].predicted = next;
+			}
+
+			auto file = opener(next);
+			if (file) {
+				posix_fadvise(file->fd, 0, 0, POSIX_FADV_WILLNEED);
+				if (chunks->enabled())
+					chunks->read(*file, 0);
+			}
+		}
+	}
+
+	uint64_t predict(const Job &job) {
+		for (unsigned i = 0; i + 1 < job.playlist.size(); i++)
+			if (job.playlist[i] == job.songid)
+				return job.playlist[i + 1];
+
+		auto song = model->getSong(job.songid);
+		if (!song)
+			return 0;
+		bool found = false;
+		for (const auto & s : model->getSongsByAlbum(song->albumid)) {
+			if (found)
+				return s.id;
+			found = (s.id == job.songid);
+		}
+		return 0;
+	}
+
+	DataModel *model;
+	ChunkCache *chunks;
+	opener_fn opener;
+	const bool enabled;
+
+	std::mutex mu;
+	std::unordered_map<std::string, UserContext> users;
+	ConcurrentQueue<Job> jobs;
+	std::thread pthread;
+	std::atomic<uint64_t> hits, misses;
+};
+
+#endif
+
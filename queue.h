@@ -5,6 +5,9 @@
 #include <atomic>
 #include <mutex>
 #include <list>
+#include <deque>
+#include <string>
+#include <unordered_map>
 #include <condition_variable>
 
 template<typename T>
@@ -46,5 +49,59 @@ private:
 	std::atomic<bool> nowriter;      // Indicates no more writes will happen
 };
 
+// Queue with a FIFO per key (ie. user), served round robin across keys so a
+// key with many queued items does not delay the items of other keys.
+template<typename T>
+class FairQueue {
+public:
+	FairQueue() : nowriter(false) {}
+
+	void close() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		nowriter = true;
+		condvar.notify_all();
+	}
+
+	void push(const std::string &key, T item) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		auto & kq = queues[key];
+		if (kq.empty())
+			active.push_back(key);
+		kq.push_back(std::move(item));
+		lock.unlock();
+		condvar.notify_one();
+	}
+
+	bool pop(T *item) noexcept {
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (active.empty() && !nowriter)
+			condvar.wait(lock);
+
+		// Writer signaled end already
+		if (nowriter)
+			return false;
+
+		// Take from the first key in turn, it goes back to the end of the
+		// line if it has more items
+		std::string key = std::move(active.front());
+		active.pop_front();
+		auto it = queues.find(key);
+		*item = std::move(it->second.front());
+		it->second.pop_front();
+		if (it->second.empty())
+			queues.erase(it);
+		else
+			active.push_back(std::move(key));
+		return true;
+	}
+
+private:
+	std::unordered_map<std::string, std::deque<T>> queues;  // FIFO per key
+	std::list<std::string> active;   // Keys with items, in serving order
+	std::mutex mutex_;  // protection mutex
+	std::condition_variable condvar; // Wait variable
+	bool nowriter;      // Indicates no more writes will happen
+};
+
 #endif
 
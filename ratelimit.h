@@ -0,0 +1,103 @@
+#ifndef _RATELIMIT__H__
+#define _RATELIMIT__H__
+
+#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+
+// Token bucket implemented as GCRA: the whole state is the "theoretical
+// arrival time" (in ns) of the next unit, updated with CAS, so taking tokens
+// never locks. "rate" is tokens per second, "burst" the bucket size.
+class TokenBucket {
+public:
+	TokenBucket(double rate, double burst)
+	  : interval(1e9 / rate), tolerance(burst * 1e9 / rate), tat(0) {}
+
+	static uint64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Takes n tokens if they are available right now
+	bool take(uint64_t n) {
+		uint64_t t = now(), old = tat.load();
+		while (true) {
+			uint64_t ntat = std::max(old, t) + (uint64_t)(n * interval);
+			if (ntat - t > tolerance)
+				return false;
+			if (tat.compare_exchange_weak(old, ntat))
+				return true;
+		}
+	}
+
+	// Takes n tokens, returns the ns to wait until they can be used
+	uint64_t reserve(uint64_t n) {
+		uint64_t t = now(), old = tat.load();
+		while (true) {
+			uint64_t ntat = std::max(old, t) + (uint64_t)(n * interval);
+			if (tat.compare_exchange_weak(old, ntat))
+				return ntat - t > tolerance ? ntat - t - tolerance : 0;
+		}
+	}
+
+private:
+	const double interval;       // ns per token
+	const uint64_t tolerance;    // ns worth of burst
+	std::atomic<uint64_t> tat;
+};
+
+// Per user request rate and streaming bandwidth limits. Buckets are created
+// the first time an (authenticated) user shows up and live forever, so every
+// thread keeps its own cache of them and only locks on a miss.
+class RateLimiter {
+public:
+	struct UserLimits {
+		UserLimits(double rps, double bps)
+		  : requests(rps, rps * burst_secs), bytes(bps, bps * burst_secs) {}
+		TokenBucket requests, bytes;
+	};
+
+	// Zero means no limit
+	RateLimiter(double rps, double bps) : rps(rps), bps(bps) {}
+
+	bool limitRequests() const { return rps > 0; }
+	bool limitBytes() const { return bps > 0; }
+
+	UserLimits *get(const std::string &user) {
+		// Per limiter, in case there is more than one (they must outlive threads)
+		static thread_local std::unordered_map<const RateLimiter*,
+			std::unordered_map<std::string, UserLimits*>> caches;
+		auto & cache = caches[this];
+		auto it = cache.find(user);
+		if (it != cache.end())
+			return it->second;
+
+		Shard &shard = shards[std::hash<std::string>()(user) % nshards];
+		std::lock_guard<std::mutex> g(shard.mu);
+		auto & ul = shard.users[user];
+		if (!ul)
+			ul.reset(new UserLimits(rps > 0 ? rps : 1, bps > 0 ? bps : 1));
+		cache[user] = ul.get();
+		return ul.get();
+	}
+
+private:
+	static const unsigned nshards = 16;
+	static constexpr double burst_secs = 2;
+
+	struct Shard {
+		std::mutex mu;
+		std::unordered_map<std::string, std::unique_ptr<UserLimits>> users;
+	};
+
+	const double rps, bps;
+	Shard shards[nshards];
+};
+
+#endif
+
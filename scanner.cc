@@ -6,11 +6,14 @@
 #include <thread>
 #include <algorithm>
 #include <set>
+#include <atomic>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <string>
 #include <openssl/sha.h>
@@ -52,11 +55,22 @@ const char * init_sql = "\
 		`cover512`	BLOB,\
 		`cover1024`	BLOB,\
 		`cover`	BLOB,\
+		`year`	INTEGER,\
+		`genre`	TEXT,\
+		`created`	INTEGER,\
+		`songcount`	INTEGER,\
+		`duration`	INTEGER,\
+		`sortkey`	TEXT,\
+		`artistsortkey`	TEXT,\
 		PRIMARY KEY(id)\
 	);\
 	CREATE TABLE `artists` (\
 		`id`	INTEGER NOT NULL UNIQUE,\
 		`name`	TEXT,\
+		`albumcount`	INTEGER,\
+		`created`	INTEGER,\
+		`sortkey`	TEXT,\
+		`indexletter`	TEXT,\
 		PRIMARY KEY(id)\
 	);\
 	CREATE TABLE `songs` (\
@@ -76,8 +90,14 @@ const char * init_sql = "\
 		`filename`	TEXT,\
 		`timestamp`	INTEGER,\
 		`filesize`	INTEGER,\
+		`seektable`	BLOB,\
 		PRIMARY KEY(id)\
 	);\
+	CREATE TABLE IF NOT EXISTS `meta` (\
+		`key`	TEXT NOT NULL UNIQUE,\
+		`value`	INTEGER,\
+		PRIMARY KEY(key)\
+	);\
 	CREATE TABLE `users` (\
 		`username`	TEXT NOT NULL UNIQUE,\
 		`password`	TEXT,\
@@ -85,6 +105,86 @@ const char * init_sql = "\
 	);\
 ";
 
+// Columns added after the initial schema, for existing databases. These are
+// run one by one since they fail if the column is already there.
+const char * migrate_sql[] = {
+	"ALTER TABLE `albums` ADD COLUMN `year` INTEGER",
+	"ALTER TABLE `albums` ADD COLUMN `genre` TEXT",
+	"ALTER TABLE `albums` ADD COLUMN `created` INTEGER",
+	"ALTER TABLE `albums` ADD COLUMN `songcount` INTEGER",
+	"ALTER TABLE `albums` ADD COLUMN `duration` INTEGER",
+	"ALTER TABLE `artists` ADD COLUMN `albumcount` INTEGER",
+	"ALTER TABLE `artists` ADD COLUMN `created` INTEGER",
+	"ALTER TABLE `artists` ADD COLUMN `sortkey` TEXT",
+	"ALTER TABLE `albums` ADD COLUMN `sortkey` TEXT",
+	"ALTER TABLE `albums` ADD COLUMN `artistsortkey` TEXT",
+	"ALTER TABLE `artists` ADD COLUMN `indexletter` TEXT",
+	"CREATE TABLE IF NOT EXISTS `meta` (`key` TEXT NOT NULL UNIQUE, `value` INTEGER, PRIMARY KEY(key))",
+	"ALTER TABLE `songs` ADD COLUMN `seektable` BLOB",
+};
+
+const char * index_sql = "\
+	CREATE INDEX IF NOT EXISTS `songs_album` ON `songs` (`albumid`);\
+	CREATE INDEX IF NOT EXISTS `artists_sortkey` ON `artists` (`sortkey`);\
+	CREATE INDEX IF NOT EXISTS `albums_sortkey` ON `albums` (`sortkey`, `id`);\
+	CREATE INDEX IF NOT EXISTS `albums_artistsort` ON `albums` (`artistid`, `sortkey`);\
+	CREATE INDEX IF NOT EXISTS `albums_artistsortkey` ON `albums` (`artistsortkey`, `sortkey`);\
+	CREATE INDEX IF NOT EXISTS `albums_year` ON `albums` (`year`);\
+	CREATE INDEX IF NOT EXISTS `albums_genre` ON `albums` (`genre`);\
+	CREATE INDEX IF NOT EXISTS `albums_created` ON `albums` (`created`);\
+";
+
+// Full text search indexes, using the tables as external content
+const char * search_sql = "\
+	CREATE VIRTUAL TABLE IF NOT EXISTS `artists_fts` USING fts5(`name`,\
+		content='artists', content_rowid='id',\
+		tokenize='unicode61 remove_diacritics 2', prefix='1 2 3');\
+	CREATE VIRTUAL TABLE IF NOT EXISTS `albums_fts` USING fts5(`title`, `artist`,\
+		content='albums', content_rowid='id',\
+		tokenize='unicode61 remove_diacritics 2', prefix='1 2 3');\
+	CREATE VIRTUAL TABLE IF NOT EXISTS `songs_fts` USING fts5(`title`, `album`, `artist`,\
+		content='songs', content_rowid='id',\
+		tokenize='unicode61 remove_diacritics 2', prefix='1 2 3');\
+	INSERT INTO `artists_fts`(`artists_fts`) VALUES('rebuild');\
+	INSERT INTO `albums_fts`(`albums_fts`) VALUES('rebuild');\
+	INSERT INTO `songs_fts`(`songs_fts`) VALUES('rebuild');\
+";
+
+// Per album and per artist data derived from songs, computed once all songs
+// are in. Grouped in a single pass over each table, so clients can get
+// complete album/artist entries from list endpoints.
+const char * aggregate_sql = "\
+	UPDATE `albums` SET\
+		`year` = agg.year, `created` = agg.created,\
+		`songcount` = agg.songcount, `duration` = agg.duration\
+	FROM (SELECT `albumid`, max(`year`) AS year, min(`timestamp`) AS created,\
+	             count(*) AS songcount, sum(`duration`) AS duration\
+	      FROM `songs` GROUP BY `albumid`) AS agg\
+	WHERE `albums`.`id` = agg.albumid;\
+	UPDATE `albums` SET\
+		`genre` = (SELECT `genre` FROM `songs` WHERE `albumid` = `albums`.`id`\
+		           GROUP BY `genre` ORDER BY count(*) DESC LIMIT 1);\
+	UPDATE `artists` SET\
+		`albumcount` = agg.albumcount, `created` = agg.created\
+	FROM (SELECT `artistid`, count(*) AS albumcount, min(`created`) AS created\
+	      FROM `albums` GROUP BY `artistid`) AS agg\
+	WHERE `artists`.`id` = agg.artistid;\
+	UPDATE `artists` SET `sortkey` = sortkey(`name`);\
+	UPDATE `artists` SET `indexletter` = indexletter(`sortkey`);\
+	UPDATE `albums` SET `sortkey` = sortkey(`title`), `artistsortkey` = sortkey(`artist`);\
+";
+
+// SQL wrappers for sortkey() and indexletter(), so keys can be computed in bulk
+template<std::string (*fn)(const std::string&)>
+void text_sqlfn(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+	const char *s = (const char*)sqlite3_value_text(argv[0]);
+	std::string r = fn(s ? s : "");
+	sqlite3_result_text(ctx, r.c_str(), r.size(), SQLITE_TRANSIENT);
+}
+
+// Set whenever a scan adds or updates any song
+std::atomic<bool> library_changed(false);
+
 void panic_if(bool cond, string text) {
 	if (cond) {
 		cerr << text << endl;
@@ -117,6 +217,111 @@ void wfn(void *ctx, void *data, int size) {
 	*((std::string*)ctx) += std::string((char*)data, size);
 }
 
+// Encoding profile for each of the cover thumbnail sizes. Quality is the JPEG
+// quality to start with, if the result exceeds maxbytes (0 means no limit) we
+// search for the highest quality that fits, down to thumb_min_quality.
+struct ThumbProfile {
+	unsigned size, quality, maxbytes;
+};
+
+ThumbProfile thumb_profiles[4] = {
+	{ 128, 50,  6*1024},
+	{ 256, 60, 16*1024},
+	{ 512, 70,       0},
+	{1024, 70,       0},
+};
+const unsigned thumb_min_quality = 20;
+
+// Parses THUMB_PROFILE like "50:6144,60:16384,70,70" (quality[:maxbytes] per size)
+void parse_thumb_profile(string prof) {
+	for (unsigned i = 0; i < 4 && !prof.empty(); i++) {
+		size_t p = prof.find(',');
+		string entry = prof.substr(0, p);
+		prof = p == string::npos ? "" : prof.substr(p + 1);
+
+		size_t c = entry.find(':');
+		if (c != 0 && !entry.empty()) {
+			int q = atoi(entry.c_str());
+			if (q < 1 || q > 100)
+				std::cerr << "Ignoring thumbnail quality " << q << " (must be 1 to 100)" << std::endl;
+			else
+				thumb_profiles[i].quality = std::max((unsigned)q, thumb_min_quality);
+		}
+		if (c != string::npos) {
+			int maxbytes = atoi(&entry[c+1]);
+			if (maxbytes < 0) {
+				std::cerr << "Ignoring negative thumbnail size limit " << maxbytes << std::endl;
+				continue;
+			}
+			thumb_profiles[i].maxbytes = maxbytes;
+		}
+	}
+}
+
+std::string encode_jpeg(const uint8_t *pixels, int w, int h, unsigned quality) {
+	std::string ret;
+	stbi_write_jpg_to_func(wfn, &ret, w, h, 3, pixels, quality);
+	return ret;
+}
+
+std::string encode_thumb(const uint8_t *pixels, int w, int h, const ThumbProfile &prof) {
+	std::string ret = encode_jpeg(pixels, w, h, prof.quality);
+	if (!prof.maxbytes || ret.size() <= prof.maxbytes)
+		return ret;
+
+	// Binary search the best quality that fits the budget, or use the lowest one
+	unsigned lo = thumb_min_quality, hi = prof.quality - 1;
+	std::string best;
+	while (lo <= hi) {
+		unsigned q = (lo + hi) / 2;
+		std::string tmp = encode_jpeg(pixels, w, h, q);
+		if (tmp.size() <= prof.maxbytes) {
+			best = std::move(tmp);
+			lo = q + 1;
+		}
+		else {
+			if (q == thumb_min_quality && best.empty())
+				best = std::move(tmp);
+			hi = q - 1;
+		}
+	}
+	// Starting at the lowest quality already (the search is empty), keep it
+	if (best.empty())
+		best = prof.quality <= thumb_min_quality ? ret : encode_jpeg(pixels, w, h, thumb_min_quality);
+	return best;
+}
+
+// Create several versions of this cover, so we can serve different sizes
+void make_thumbnails(const string &cover, std::string smallcover[4]) {
+	int width, height, nchan;
+	stbi_uc *original = stbi_load_from_memory((uint8_t*)cover.c_str(), cover.size(),
+	                                          &width, &height, &nchan, 3);
+	if (!original)
+		return;
+
+	for (unsigned i = 0; i < 4; i++) {
+		int nw, nh;
+		unsigned tsize = thumb_profiles[i].size;
+		if (width > height) {
+			nw = tsize;
+			nh = tsize * (double)height / (double)width;
+		}else{
+			nh = tsize;
+			nw = tsize * (double)width / (double)height;
+		}
+
+		// We only shrink, never enlarge
+		if (nw <= width && nh <= height) {
+			unsigned osize = nw*nh*3;
+			std::string tmpb(osize, '\0');
+			stbir_resize_uint8(original, width, height, 0, (uint8_t*)&tmpb[0], nw, nh, 0, 3);
+
+			smallcover[i] = encode_thumb((uint8_t*)tmpb.c_str(), nw, nh, thumb_profiles[i]);
+		}
+	}
+	stbi_image_free(original);
+}
+
 std::set<uint64_t> processed_albums;
 std::mutex albummutex;
 
@@ -131,35 +336,9 @@ void insert_album(sqlite3 * sqldb, string album, string artist, string cover) {
 		processed_albums.insert(albumid);
 	}
 
-	// Create several versions of this cover, so we can serve different sizes
-	const unsigned sizes[4] = {128, 256, 512, 1024};
 	std::string smallcover[4];
-	if (cover.size()) {
-		int width, height, nchan;
-		stbi_uc *original = stbi_load_from_memory((uint8_t*)cover.c_str(), cover.size(),
-		                                          &width, &height, &nchan, 3);
-
-		for (unsigned i = 0; i < 4; i++) {
-			int nw, nh;
-			if (width > height) {
-				nw = sizes[i];
-				nh = sizes[i] * (double)height / (double)width;
-			}else{
-				nh = sizes[i];
-				nw = sizes[i] * (double)width / (double)height;
-			}
-
-			// We only shrink, never enlarge
-			if (nw <= width && nh <= height) {
-				unsigned osize = nw*nh*3;
-				std::string tmpb(osize, '\0');
-				stbir_resize_uint8(original, width, height, 0, (uint8_t*)&tmpb[0], nw, nh, 0, 3);
-
-				stbi_write_jpg_to_func(wfn, &smallcover[i], nw, nh, 3, tmpb.c_str(), 70);
-			}
-		}
-		stbi_image_free(original);
-	}
+	if (cover.size())
+		make_thumbnails(cover, smallcover);
 
 	sqlite3_stmt *stmt;
 	sqlite3_prepare_v2(sqldb, "INSERT OR REPLACE INTO `albums` "
@@ -180,16 +359,155 @@ void insert_album(sqlite3 * sqldb, string album, string artist, string cover) {
 	sqlite3_finalize(stmt);
 }
 
+// Seek tables (see seektable_lookup) get a point every second at least,
+// but no more than max_seekpoints per song to keep them compact.
+const unsigned max_seekpoints = 1024;
+
+static unsigned seek_interval(uint64_t duration_ms) {
+	return std::max(1000UL, (unsigned long)(duration_ms / max_seekpoints));
+}
+
+// Returns the MPEG audio frame size and sample count for a frame header, 0 if invalid
+static unsigned mp3_frame(const uint8_t *h, unsigned *samples, unsigned *srate) {
+	static const unsigned short bitrates[2][3][16] = {
+		{ // MPEG1 layers I, II, III
+			{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0},
+			{0, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384, 0},
+			{0, 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 0},
+		}, { // MPEG2/2.5 layers I, II, III
+			{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0},
+			{0,  8, 16, 24, 32, 40, 48,  56,  64,  80,  96, 112, 128, 144, 160, 0},
+			{0,  8, 16, 24, 32, 40, 48,  56,  64,  80,  96, 112, 128, 144, 160, 0},
+		}};
+	static const unsigned srates[3] = {44100, 48000, 32000};
+
+	if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0)
+		return 0;
+	unsigned version = (h[1] >> 3) & 3;   // 0: 2.5, 2: 2, 3: 1
+	unsigned layer = 4 - ((h[1] >> 1) & 3);  // 4 is reserved
+	unsigned bridx = h[2] >> 4, sridx = (h[2] >> 2) & 3, pad = (h[2] >> 1) & 1;
+	if (version == 1 || layer == 4 || !bridx || bridx == 15 || sridx == 3)
+		return 0;
+
+	bool v1 = (version == 3);
+	unsigned bitrate = bitrates[v1 ? 0 : 1][layer - 1][bridx] * 1000;
+	*srate = srates[sridx] >> (v1 ? 0 : version == 2 ? 1 : 2);
+	if (layer == 1) {
+		*samples = 384;
+		return (12 * bitrate / *srate + pad) * 4;
+	}
+	*samples = (layer == 3 && !v1) ? 576 : 1152;
+	return *samples / 8 * bitrate / *srate + pad;
+}
+
+// Walks MP3 frames (skipping the ID3v2 tag) recording frame offsets
+static string mp3_seektable(const uint8_t *data, uint64_t size, uint64_t duration_ms) {
+	uint64_t pos = 0;
+	if (size >= 10 && !memcmp(data, "ID3", 3))
+		pos = 10 + (((data[6] & 0x7F) << 21) | ((data[7] & 0x7F) << 14) |
+		            ((data[8] & 0x7F) <<  7) |  (data[9] & 0x7F)) +
+		      ((data[5] & 0x10) ? 10 : 0);
+
+	string table = i322a(0);
+	unsigned interval = seek_interval(duration_ms);
+	uint64_t samples = 0, nextms = 0;
+	while (pos + 4 <= size && pos <= 0xFFFFFFFFULL) {
+		unsigned fsamples, srate;
+		unsigned flen = mp3_frame(&data[pos], &fsamples, &srate);
+		// When looking for sync make sure the next frame header is valid too
+		unsigned nsamples, nsrate;
+		if (!flen || (pos + flen + 4 <= size && !mp3_frame(&data[pos + flen], &nsamples, &nsrate))) {
+			pos++;
+			continue;
+		}
+
+		uint64_t ms = samples * 1000 / srate;
+		if (ms >= nextms) {
+			table += i322a(ms) + i322a(pos);
+			nextms = ms + interval;
+		}
+		samples += fsamples;
+		pos += flen;
+	}
+	return table;
+}
+
+// Walks Ogg pages of the first logical stream. A page is a seek point for the
+// time of the previous page granule (where its first packet starts).
+static string ogg_seektable(const uint8_t *data, uint64_t size, uint64_t duration_ms,
+                            unsigned srate) {
+	string table;
+	unsigned interval = seek_interval(duration_ms);
+	uint64_t pos = 0, nextms = 0;
+	int64_t lastgranule = -1;
+	uint32_t serial = 0;
+	while (pos + 27 <= size && pos <= 0xFFFFFFFFULL && srate) {
+		if (memcmp(&data[pos], "OggS", 4))
+			break;
+		unsigned nsegs = data[pos + 26];
+		if (pos + 27 + nsegs > size)
+			break;
+		uint64_t plen = 27 + nsegs;
+		for (unsigned i = 0; i < nsegs; i++)
+			plen += data[pos + 27 + i];
+
+		int64_t granule = (int64_t)a2i64(&data[pos + 6]);
+		if (table.empty())
+			serial = a2i32(&data[pos + 14]);
+		else if (a2i32(&data[pos + 14]) != serial)
+			break;   // Chained or multiplexed streams are not handled
+
+		// Headers live in the pages before the first one with a granule
+		if (table.empty() && granule > 0)
+			table = i322a(pos);
+		if (!table.empty() && lastgranule >= 0) {
+			uint64_t ms = lastgranule * 1000 / srate;
+			if (ms >= nextms) {
+				table += i322a(ms) + i322a(pos);
+				nextms = ms + interval;
+			}
+		}
+		if (granule >= 0)
+			lastgranule = granule;
+		pos += plen;
+	}
+	return table;
+}
+
+// Builds the seek table for a song, empty if it could not be built
+string build_seektable(string fullpath, string ext, uint64_t duration_ms, unsigned srate) {
+	int fd = open(fullpath.c_str(), O_RDONLY);
+	if (fd < 0)
+		return {};
+
+	string table;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			if (ext == "mp3")
+				table = mp3_seektable((uint8_t*)data, st.st_size, duration_ms);
+			else if (ext == "ogg")
+				table = ogg_seektable((uint8_t*)data, st.st_size, duration_ms, srate);
+			munmap(data, st.st_size);
+		}
+	}
+	close(fd);
+	return table.size() > 4 ? table : string();
+}
+
 void insert_song(sqlite3 * sqldb, string filename, string title,
                  string artist, string album, string type, string genre,
                  unsigned tn, unsigned year, unsigned discn, unsigned duration,
-                 unsigned bitrate, uint64_t timestamp, uint64_t filesize) {
+                 unsigned bitrate, uint64_t timestamp, uint64_t filesize,
+                 const string &seektable) {
 
 	sqlite3_stmt *stmt;
 	sqlite3_prepare_v2(sqldb, "INSERT OR REPLACE INTO `songs` "
 		"(`id`, `title`, `albumid`, `album`, `artistid`, `artist`, `type`, `genre`, "
-		"`trackn`, `year`, `discn`, `duration`, `bitRate`, `filename`, `timestamp`, `filesize`)"
-		" VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?);", -1, &stmt, NULL);
+		"`trackn`, `year`, `discn`, `duration`, `bitRate`, `filename`, `timestamp`, `filesize`, "
+		"`seektable`) VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?);", -1, &stmt, NULL);
 
 	sqlite3_bind_int64(stmt, 1, calcId(to_string(tn) + "@" + to_string(discn) + "@" + title + "@" + album + "@" + artist, TYPE_SONG));
 	sqlite3_bind_text (stmt, 2, title.c_str(), -1, NULL);
@@ -207,6 +525,10 @@ void insert_song(sqlite3 * sqldb, string filename, string title,
 	sqlite3_bind_text (stmt,14, filename.c_str(), -1, NULL);
 	sqlite3_bind_int64(stmt,15, timestamp);
 	sqlite3_bind_int64(stmt,16, filesize);
+	if (seektable.empty())
+		sqlite3_bind_null(stmt, 17);
+	else
+		sqlite3_bind_blob(stmt, 17, seektable.data(), seektable.size(), NULL);
 
 	if (sqlite3_step(stmt) != SQLITE_DONE) {
 		cout << "Err " << filename << endl;
@@ -314,10 +636,12 @@ void scan_music_file(sqlite3 * sqldb, string fullpath) {
 	insert_song(sqldb, fullpath, tag->title().toCString(true), albumartist,
 		tag->album().toCString(true), ext, tag->genre().toCString(true),
 		tag->track(), tag->year(), discn, properties->length(), properties->bitrate(),
-		attrs.st_mtime, attrs.st_size);
+		attrs.st_mtime, attrs.st_size,
+		build_seektable(fullpath, ext, properties->lengthInMilliseconds(), properties->sampleRate()));
 
 	insert_album(sqldb, tag->album().toCString(true), albumartist, cover);
 	insert_artist(sqldb, albumartist);
+	library_changed = true;
 }
 
 void scan_fs(string name, ConcurrentQueue<std::string> *fileq) {
@@ -350,6 +674,41 @@ void scan_worker(sqlite3 * sqldb, ConcurrentQueue<std::string> *fileq) {
 		scan_music_file(sqldb, filename);
 }
 
+// Prints thumbnail sizes stored in the DB vs what the current profile would produce
+void cover_report(sqlite3 * sqldb) {
+	const char *fields[4] = { "cover128", "cover256", "cover512", "cover1024" };
+	uint64_t cnt = 0, stored[4] = {0}, reenc[4] = {0}, nthumb[4] = {0};
+
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(sqldb, "SELECT cover, cover128, cover256, cover512, cover1024 "
+	                   "FROM albums WHERE hascover = 1", -1, &stmt, NULL);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		string cover((char*)sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+		std::string smallcover[4];
+		make_thumbnails(cover, smallcover);
+		for (unsigned i = 0; i < 4; i++) {
+			if (!sqlite3_column_bytes(stmt, i + 1))
+				continue;
+			nthumb[i]++;
+			stored[i] += sqlite3_column_bytes(stmt, i + 1);
+			reenc[i] += smallcover[i].size();
+		}
+		cnt++;
+	}
+	sqlite3_finalize(stmt);
+
+	cout << cnt << " albums with cover" << endl;
+	for (unsigned i = 0; i < 4; i++) {
+		if (!nthumb[i])
+			continue;
+		cout << fields[i] << ": " << nthumb[i] << " thumbs, avg "
+		     << stored[i] / nthumb[i] << " bytes stored, avg "
+		     << reenc[i] / nthumb[i] << " bytes with profile (q"
+		     << thumb_profiles[i].quality << ", max "
+		     << thumb_profiles[i].maxbytes << " bytes)" << endl;
+	}
+}
+
 void status_thread(ConcurrentQueue<std::string> *fileq) {
 	while (!fileq->closed()) {
 		std::cout << (fileq->queued() - fileq->size()) << "/" << fileq->queued() << "      \r";
@@ -364,14 +723,16 @@ int main(int argc, char* argv[]) {
 			"Usage: %s action [args...]\n"
 			"  %s scan file.db musicdir/ \n"
 			"  %s useradd file.db username password\n"
-			"  %s userdel file.db username\n",
-			argv[0],argv[0],argv[0],argv[0]);
+			"  %s userdel file.db username\n"
+			"  %s coverreport file.db\n",
+			argv[0],argv[0],argv[0],argv[0],argv[0]);
 		return 1;
 	}
 	string action = argv[1];
 	string dbpath = argv[2];
 	unsigned nthreads = atoi(getenv("NTHREADS") ? : "4") & 255;
 	std::cerr << "Using " << nthreads << " threads" << std::endl;
+	parse_thumb_profile(getenv("THUMB_PROFILE") ? : "");
 
 	// Create a new sqlite db if file does not exist
 	sqlite3 * sqldb;
@@ -383,11 +744,17 @@ int main(int argc, char* argv[]) {
 	);
 	panic_if(ok != SQLITE_OK, "Could not open sqlite3 database!");
 	sqlite3_exec(sqldb, "PRAGMA synchronous = OFF", NULL, NULL, NULL);
+	sqlite3_create_function(sqldb, "sortkey", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+	                        NULL, text_sqlfn<sortkey>, NULL, NULL);
+	sqlite3_create_function(sqldb, "indexletter", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+	                        NULL, text_sqlfn<indexletter>, NULL, NULL);
 
 	if (action == "scan") {
 		string musicdir = argv[3];
 
 		sqlite3_exec(sqldb, init_sql, NULL, NULL, NULL);
+		for (auto sql : migrate_sql)
+			sqlite3_exec(sqldb, sql, NULL, NULL, NULL);
 
 		// Start scanning and adding stuff to the database
 		ConcurrentQueue<std::string> fileq(1024);
@@ -399,7 +766,21 @@ int main(int argc, char* argv[]) {
 		fileq.close();
 		for (auto & t : tpool)
 			t.join();
+
+		sqlite3_exec(sqldb, index_sql, NULL, NULL, NULL);
+		sqlite3_exec(sqldb, aggregate_sql, NULL, NULL, NULL);
+		sqlite3_exec(sqldb, search_sql, NULL, NULL, NULL);
+
+		// Let the server (and its clients) know the library changed
+		if (library_changed)
+			sqlite3_exec(sqldb, "INSERT OR REPLACE INTO `meta` (`key`, `value`) "
+			             "VALUES ('lastmodified', strftime('%s', 'now') * 1000);"
+			             "INSERT INTO `meta` (`key`, `value`) VALUES ('generation', 1) "
+			             "ON CONFLICT(`key`) DO UPDATE SET `value` = `value` + 1;", NULL, NULL, NULL);
+		sqlite3_exec(sqldb, "ANALYZE", NULL, NULL, NULL);
 	}
+	if (action == "coverreport")
+		cover_report(sqldb);
 	if (action == "useradd") {
 		string user = argv[3];
 		string pass = argv[4];
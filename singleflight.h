@@ -0,0 +1,61 @@
+#ifndef _SINGLEFLIGHT__H__
+#define _SINGLEFLIGHT__H__
+
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <string>
+#include <functional>
+#include <unordered_map>
+
+// Coalesces concurrent computations of the same key: the first caller runs
+// the function and any caller arriving while it runs waits for it and gets
+// the same result instead of computing it again.
+template<typename V>
+class SingleFlight {
+public:
+	SingleFlight() : coalesced(0) {}
+
+	V run(const std::string &key, std::function<V()> fn) {
+		std::unique_lock<std::mutex> lock(mu);
+		auto it = inflight.find(key);
+		if (it != inflight.end()) {
+			auto f = it->second;
+			coalesced++;
+			lock.unlock();
+			return f.get();
+		}
+
+		std::promise<V> p;
+		inflight.emplace(key, p.get_future().share());
+		lock.unlock();
+
+		// Make sure waiters are released (and the key removed) no matter what
+		try {
+			V ret = fn();
+			p.set_value(ret);
+			finish(key);
+			return ret;
+		} catch (...) {
+			p.set_exception(std::current_exception());
+			finish(key);
+			throw;
+		}
+	}
+
+	uint64_t getCoalesced() const { return coalesced; }
+
+private:
+	void finish(const std::string &key) {
+		std::lock_guard<std::mutex> g(mu);
+		inflight.erase(key);
+	}
+
+	std::mutex mu;
+	std::unordered_map<std::string, std::shared_future<V>> inflight;
+	std::atomic<uint64_t> coalesced;
+};
+
+#endif
+
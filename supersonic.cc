@@ -6,10 +6,15 @@
 #include <list>
 #include <thread>
 #include <memory>
+#include <set>
+#include <map>
+#include <mutex>
 #include <unordered_map>
 #include <fcgio.h>
 #include <unistd.h>
 #include <signal.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "argparse/argparse.hpp"
 #include "util.h"
@@ -17,6 +22,13 @@
 #include "datamodel.h"
 #include "userdata.h"
 #include "fcgihelper.h"
+#include "filecache.h"
+#include "prefetch.h"
+#include "iopool.h"
+#include "timerwheel.h"
+#include "ratelimit.h"
+#include "workerpool.h"
+#include "singleflight.h"
 #include "resphelper.h"
 
 #define getone(m, k, def) \
@@ -24,16 +36,74 @@
 
 
 struct web_req {
-	uint64_t offset, lastbyte;
 	std::string method, host, uri;
+	std::string range, ifrange;
+	std::string ifnonematch, ifmodifiedsince;
 	std::unordered_multimap<std::string, std::string> vars;
+	std::string extra_headers;   // Set by the handler, sent along its response
+	std::string etag, headkey;   // Set for responses whose headers can be reused by HEAD
 };
 
-static uint64_t fsize(FILE *fd) {
-	fseeko(fd, 0, SEEK_END);
-	uint64_t r = ftello(fd);
-	fseeko(fd, 0, SEEK_SET);
-	return r;
+// Work for the worker pools: a new request, or one being answered whose
+// responder had to wait (ie. a paced stream) and carries on where it left.
+struct PoolJob {
+	std::unique_ptr<FCGX_Request> req;
+	std::unique_ptr<fcgi_responder> resp;
+	std::string user;
+	bool head = false;
+};
+typedef WorkerPool<PoolJob> ReqPool;
+
+// Responses to these only change when the library or user data changes, so
+// they carry validators (ETag/Last-Modified) and support conditional GETs
+static const std::set<std::string> cacheable_uris = {
+	"/rest/getMusicDirectory.view", "/rest/getAlbumList.view", "/rest/getAlbumList2.view",
+	"/rest/getArtist.view", "/rest/getAlbum.view", "/rest/getArtists.view",
+	"/rest/getIndexes.view", "/rest/search.view", "/rest/search2.view",
+	"/rest/search3.view", "/rest/getPlaylist.view", "/rest/getPlaylists.view",
+	"/rest/getCoverArt.view", "/rest/getMusicFolders.view", "/rest/getGenres.view",
+};
+
+// Opens a song file, resolving its path (using the search dirs for
+// relative ones) unless it is already cached. Shared by workers and prefetcher.
+static std::shared_ptr<OpenFile> open_song(DataModel *model, FileCache *files,
+                                           const std::vector<std::string> &sdirs, uint64_t id) {
+	uint64_t generation = model->getLibraryVersion().generation;
+	std::string path;
+	auto file = files->get(id, generation, &path);
+	if (file)
+		return file;
+
+	int fd = -1;
+	if (!path.empty())
+		fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	else {
+		std::string fname = model->getSongFile(id);
+		if (fname.empty())
+			return nullptr;
+		if (fname[0] == '/')
+			// Use absolute path as is
+			fd = open((path = fname).c_str(), O_RDONLY | O_CLOEXEC);
+		else {
+			// Try to open the file using all the search paths
+			for (const auto & dir : sdirs) {
+				fd = open((path = dir + "/" + fname).c_str(), O_RDONLY | O_CLOEXEC);
+				if (fd >= 0)
+					break;
+			}
+		}
+	}
+
+	struct stat st;
+	if (fd < 0)
+		return nullptr;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return nullptr;
+	}
+	file = std::make_shared<OpenFile>(fd, st);
+	files->put(id, generation, path, file);
+	return file;
 }
 
 class SupersonicServer {
@@ -47,61 +117,325 @@ private:
 	// Thread to spawn
 	std::thread cthread;
 
-	// Shared queue
-	ConcurrentQueue<std::unique_ptr<FCGX_Request>> *rq;
+	// Pool this worker belongs to (and gets requests from)
+	ReqPool *pool;
 
 	// Search directories
 	std::vector<std::string> sdirs;
 
+	// Resolved song paths and open files, shared by all workers
+	FileCache *files;
+
+	// Warms up the songs users are likely to play next
+	Prefetcher *prefetch;
+
+	// Reads song data ahead of the responders
+	IOPool *io;
+
+	// Stream pacing, as a factor of the song bitrate (0 disables it). The
+	// first seconds of audio are sent right away to fill client buffers.
+	// Streams ahead of schedule (or out of user bandwidth) are parked in the
+	// wheel, not in a worker.
+	double pacing;
+	TimerWheel *wheel;
+	static const unsigned pace_burst_secs = 20;
+
+	// Ranges from the start of a song shorter than this don't count as plays
+	static const uint64_t play_probe_bytes = 16*1024;
+
+	// Per user request/bandwidth limits
+	RateLimiter *limiter;
+
 	// CORS origin (if any)
 	std::string cors_origin;
 
 	// Signal end of workers
 	bool end;
 
+	// Server start time, part of ETags since user data generations restart
+	static time_t boot_time;
+
+	// Headers of rendered API responses (keyed by request, tagged with the
+	// ETag they were rendered for) so HEAD requests can skip rendering.
+	static std::mutex headmutex;
+	static std::unordered_map<std::string, std::pair<std::string, std::string>> headcache;
+
+	// Request key for the header cache, credentials are left out
+	static std::string headKey(const web_req &req) {
+		std::map<std::string, std::string> svars;
+		for (const auto & v : req.vars)
+			if (v.first != "p" && v.first != "t" && v.first != "s")
+				svars.emplace(v.first, v.second);
+		std::string key = req.uri;
+		for (const auto & v : svars)
+			key += "&" + v.first + "=" + v.second;
+		return key;
+	}
+
+	void storeHead(const web_req &req, const std::string &header) {
+		std::lock_guard<std::mutex> g(headmutex);
+		if (headcache.size() >= 4096)
+			headcache.clear();
+		headcache[req.headkey] = std::make_pair(req.etag, header);
+	}
+
+	// Response shared by coalesced requests
+	struct FlightResult {
+		std::string header, body;
+	};
+	static SingleFlight<std::shared_ptr<const FlightResult>> inflight;
+
+	// Serves a shared response in slices, so no request copies the whole body
+	class flight_responder : public fcgi_responder {
+	public:
+		flight_responder(std::shared_ptr<const FlightResult> res) : res(res), off(0) {}
+		virtual std::string header() { return res->header; }
+		virtual std::string respond() {
+			const size_t blocksize = 64*1024;
+			if (off >= res->body.size())
+				return "";
+			size_t n = std::min(blocksize, res->body.size() - off);
+			off += n;
+			return res->body.substr(off - n, n);
+		}
+	private:
+		std::shared_ptr<const FlightResult> res;
+		size_t off;
+	};
+
+	// Coalescing key: like the header cache one, but cover art does not
+	// depend on the user (nor any response on the client name/version)
+	static std::string flightKey(const web_req &req) {
+		std::map<std::string, std::string> svars;
+		bool anyuser = (req.uri == "/rest/getCoverArt.view");
+		for (const auto & v : req.vars)
+			if (v.first != "p" && v.first != "t" && v.first != "s" && v.first != "c" &&
+			    v.first != "v" && (v.first != "u" || !anyuser))
+				svars.emplace(v.first, v.second);
+		std::string key = req.uri;
+		for (const auto & v : svars)
+			key += "&" + v.first + "=" + v.second;
+		return key;
+	}
+
+	bool lookupHead(const web_req &req, std::string *header) {
+		std::lock_guard<std::mutex> g(headmutex);
+		auto it = headcache.find(req.headkey);
+		if (it == headcache.end() || it->second.first != req.etag)
+			return false;
+		*header = it->second.second;
+		return true;
+	}
+
+	// Streams a file, or some byte ranges of it (as multipart/byteranges if
+	// more than one). Without a file it can still answer HEAD requests.
 	class stream_responder : public fcgi_responder {
 	public:
-		stream_responder(FILE* f, uint64_t offset = 0, uint64_t size = ~0ULL)
-		  : f(f), offset(offset), ret_size(size) {
-			// Seek to offset
-			fseeko(f, offset, SEEK_SET);
+		// Non partial responses send all the ranges back to back
+		stream_responder(std::shared_ptr<OpenFile> f, IOPool *io, uint64_t total,
+		                 const range_list &ranges, bool partial, std::string extra)
+		  : f(f), io(io), total(total), ranges(ranges), partial(partial),
+		    extra(extra), cur(0), pos(0), remaining(0), started(false), blockn(0), aheadn(0),
+		    bucket(nullptr), rate(0), burst(0), sent(0), scheduled(false) {}
+
+		// Takes the bytes sent from a (user) bandwidth bucket, waiting if empty
+		void throttle(TokenBucket *b) {
+			bucket = b;
+		}
+
+		// Sends "burst" bytes right away and then "rate" bytes per second
+		void pace(uint64_t bytespersec, uint64_t burstbytes) {
+			rate = bytespersec;
+			burst = burstbytes;
+			pstart = TimerWheel::clock::now();
 		}
-		~stream_responder() { if (f) fclose(f); }
 
 		virtual std::string header() {
-			if (ret_size != ~0ULL || offset > 0)
-				return "Status: 206\r\n"
-					"Content-Type: application/octet-stream\r\n"
-					"Content-Range: bytes " +
-						std::to_string(offset) + "-" + std::to_string(offset + ret_size - 1) + "/*\r\n"
-					"Content-Length: " + std::to_string(ret_size) + "\r\n";
-			else
+			const std::string &h = extra;
+			if (!partial) {
+				uint64_t length = 0;
+				for (const auto & r : ranges)
+					length += r.second - r.first + 1;
 				return "Status: 200\r\n"
 					"Content-Type: application/octet-stream\r\n"
-					"Content-Length: " + std::to_string(ret_size) + "\r\n";
+					"Content-Length: " + std::to_string(length) + "\r\n" + h;
+			}
+			if (ranges.size() == 1)
+				return "Status: 206\r\n"
+					"Content-Type: application/octet-stream\r\n"
+					"Content-Range: " + contentRange(ranges[0]) + "\r\n"
+					"Content-Length: " + std::to_string(ranges[0].second - ranges[0].first + 1) + "\r\n" + h;
+
+			uint64_t length = trailer().size();
+			for (unsigned i = 0; i < ranges.size(); i++)
+				length += partHeader(i).size() + ranges[i].second - ranges[i].first + 1;
+			return "Status: 206\r\n"
+				"Content-Type: multipart/byteranges; boundary=" + std::string(boundary()) + "\r\n"
+				"Content-Length: " + std::to_string(length) + "\r\n" + h;
+		}
+
+		// Paced and throttled streams wait until the next chunk is due. Its
+		// send time (and bucket tokens) are worked out once per chunk.
+		virtual uint64_t wait() {
+			if (!f || cur >= ranges.size() || (!rate && !bucket))
+				return 0;
+			auto now = TimerWheel::clock::now();
+			if (!scheduled) {
+				readyat = now;
+				if (rate && sent > burst)
+					readyat = pstart + std::chrono::milliseconds((sent - burst) * 1000 / rate);
+				if (bucket) {
+					uint64_t next = started ? remaining : ranges[cur].second - ranges[cur].first + 1;
+					uint64_t wait = bucket->reserve(next < blocksize ? next : blocksize);
+					readyat = std::max(readyat, now + std::chrono::nanoseconds(wait));
+				}
+				scheduled = true;
+			}
+			return readyat > now ? std::chrono::duration_cast<std::chrono::nanoseconds>(readyat - now).count() : 0;
 		}
 
 		virtual std::string respond() {
-			// Send "small" chunks as response, so we can easily abort if needed.
-			const size_t blocksize = 64*1024;
-			size_t toread = ret_size < blocksize ? ret_size : blocksize;
-			if (!toread)
+			if (!f)
+				return {};
+			std::string out;
+			bool multipart = partial && ranges.size() > 1;
+			if (cur >= ranges.size()) {
+				// Close the multipart body once
+				if (multipart && cur++ == ranges.size())
+					return trailer();
 				return {};   // EOF
+			}
+			if (!started) {
+				if (multipart)
+					out = partHeader(cur);
+				pos = ranges[cur].first;
+				remaining = ranges[cur].second - ranges[cur].first + 1;
+				started = true;
+			}
 
-			char tmpbuf[blocksize];
-			size_t read = fread(tmpbuf, 1, toread, f);
-			if (read >= 0) {
-				ret_size -= read;
-				return std::string(tmpbuf, read);
+			// Send "small" chunks as response, so we can easily abort if needed.
+			size_t toread = remaining < blocksize ? remaining : blocksize;
+			scheduled = false;
+
+			uint64_t bn = pos / ChunkCache::block_size;
+			if (!block || blockn != bn) {
+				if (ahead.valid() && aheadn == bn)
+					block = ahead.get();
+				else
+					block = io->read(*f, bn);
+				blockn = bn;
+
+				// Get the next block of the range read while this one is sent
+				aheadn = bn + 1;
+				if (aheadn * ChunkCache::block_size <= ranges[cur].second)
+					ahead = io->readAhead(f, aheadn);
+			}
+
+			// Chunks never span two blocks
+			uint64_t boff = pos % ChunkCache::block_size;
+			size_t read = block->size() > boff ? std::min(toread, (size_t)(block->size() - boff)) : 0;
+			out.append(*block, boff, read);
+			pos += read;
+			sent += read;
+			remaining -= read;
+			if (!read)
+				cur = ranges.size() + 1;   // File got truncated, give up
+			else if (!remaining) {
+				cur++;
+				started = false;
 			}
-			return {};
+			return out;
 		}
 
 	private:
-		FILE* f;
-		uint64_t offset, ret_size;
+		static const size_t blocksize = 64*1024;
+		static const char *boundary() { return "SUPERSONIC_BYTERANGES"; }
+
+		std::string contentRange(const std::pair<uint64_t, uint64_t> &r) const {
+			return "bytes " + std::to_string(r.first) + "-" + std::to_string(r.second) +
+			       "/" + std::to_string(total);
+		}
+		std::string partHeader(unsigned i) const {
+			return "\r\n--" + std::string(boundary()) + "\r\n"
+			       "Content-Type: application/octet-stream\r\n"
+			       "Content-Range: " + contentRange(ranges[i]) + "\r\n\r\n";
+		}
+		std::string trailer() const {
+			return "\r\n--" + std::string(boundary()) + "--\r\n";
+		}
+
+		std::shared_ptr<OpenFile> f;
+		IOPool *io;
+		uint64_t total;
+		range_list ranges;
+		bool partial;
+		std::string extra;
+		unsigned cur;
+		uint64_t pos, remaining;
+		bool started;
+		ChunkCache::Block block;           // Block being sent
+		std::future<ChunkCache::Block> ahead;  // Next block, being read
+		uint64_t blockn, aheadn;
+		TokenBucket *bucket;
+		uint64_t rate, burst, sent;
+		TimerWheel::clock::time_point pstart, readyat;
+		bool scheduled;   // readyat is set for the next chunk
 	};
 
+	// Builds the response for a song file of the given size and modification
+	// time, honouring Range/If-Range. "fd" can be NULL for HEAD requests.
+	// Sets "newplay" when the response starts playing the song: the whole file
+	// or a range from its start that goes past play_probe_bytes (clients probe
+	// with tiny ranges like bytes=0-1 before the real request).
+	// A seek offset (and its header prefix) produces a new, shorter stream.
+	// Data is paced at "rate" bytes/s (after an initial burst) if not zero,
+	// and throttled by the user bandwidth bucket if any.
+	fcgi_responder* streamFile(const web_req &req, std::shared_ptr<OpenFile> fd, uint64_t total,
+	                           time_t mtime, uint64_t seekoff, uint64_t prefix,
+	                           uint64_t rate, TokenBucket *bucket, bool *newplay) {
+		*newplay = false;
+		stream_responder *resp;
+		if (seekoff && seekoff < total) {
+			range_list ranges;
+			prefix = std::min(prefix, seekoff);
+			if (prefix)
+				ranges.emplace_back(0, prefix - 1);
+			ranges.emplace_back(seekoff, total - 1);
+			resp = new stream_responder(fd, io, total, ranges, false, "");
+			if (rate)
+				resp->pace(rate, rate * pace_burst_secs);
+			if (bucket)
+				resp->throttle(bucket);
+			return resp;
+		}
+
+		std::string etag = "\"" + std::to_string(total) + "-" + std::to_string(mtime) + "\"";
+		std::string lastmod = httpdate(mtime);
+
+		// If-Range (strong comparison) makes us ignore Range if the file changed
+		bool rangeok = req.ifrange.empty() || req.ifrange == etag || req.ifrange == lastmod;
+
+		range_list ranges;
+		bool partial = rangeok && parse_range(req.range, total, &ranges);
+		if (partial && ranges.empty())
+			return new str_resp(
+				"Status: 416\r\n"
+				"Content-Range: bytes */" + std::to_string(total) + "\r\n"
+				"Content-Length: 0\r\n", "");
+		if (!partial && total)
+			ranges.emplace_back(0, total - 1);
+
+		*newplay = !partial || (ranges[0].first == 0 && (ranges[0].second + 1 >= total ||
+		                                                 ranges[0].second + 1 >= play_probe_bytes));
+		resp = new stream_responder(fd, io, total, ranges, partial,
+			"Accept-Ranges: bytes\r\nETag: " + etag + "\r\nLast-Modified: " + lastmod + "\r\n");
+		if (rate)
+			resp->pace(rate, rate * pace_burst_secs);
+		if (bucket)
+			resp->throttle(bucket);
+		return resp;
+	}
+
 	bool checkCredentials(std::string user, web_req& req) {
 		if (user.empty())
 			return false;
@@ -144,9 +478,69 @@ private:
 		if (!checkCredentials(user, req))
 			return authErr(req);
 
+		// Enforce per user limits: API calls over the limit are rejected,
+		// streams are throttled instead.
+		bool isstream = (req.uri == "/rest/stream.view" || req.uri == "/rest/download.view");
+		RateLimiter::UserLimits *ulimits = nullptr;
+		if (limiter->limitRequests() || limiter->limitBytes())
+			ulimits = limiter->get(user);
+		if (limiter->limitRequests() && !isstream && !ulimits->requests.take(1))
+			return respond_too_many_requests();
+
+		// Answer conditional requests right away if nothing changed
+		std::string ltype = getone(req.vars, "type", "");
+		if (cacheable_uris.count(req.uri) && ltype != "random" &&
+		    ltype != "recent" && ltype != "frequent") {
+			auto libv = model->getLibraryVersion();
+			std::string etag = "\"" + std::to_string(libv.generation) + "-" +
+			                   std::to_string(udata->getGeneration()) + "-" +
+			                   std::to_string(boot_time) + "\"";
+			time_t lastmod = std::max((time_t)(libv.lastmodified / 1000), udata->getLastWrite());
+			req.extra_headers = "ETag: " + etag + "\r\n"
+			                    "Last-Modified: " + httpdate(lastmod) + "\r\n"
+			                    "Cache-Control: private, no-cache\r\n";
+
+			if (!req.ifnonematch.empty()) {
+				if (req.ifnonematch.find(etag) != std::string::npos || req.ifnonematch == "*")
+					return respond_not_modified();
+			}
+			else if (!req.ifmodifiedsince.empty()) {
+				time_t ims = parse_httpdate(req.ifmodifiedsince);
+				if (ims && lastmod <= ims)
+					return respond_not_modified();
+			}
+
+			// HEAD gets the headers of the last equivalent response if still valid
+			req.etag = etag;
+			req.headkey = headKey(req);
+			std::string head;
+			if (req.method == "HEAD" && lookupHead(req, &head))
+				return new str_resp(head, "");
+		}
+
+		// Identical concurrent requests (credentials aside) share one response
+		if (req.method == "GET" && !req.headkey.empty()) {
+			auto res = inflight.run(flightKey(req), [&] () {
+				std::unique_ptr<fcgi_responder> resp(dispatch(req, fastcgi_req, user, ulimits));
+				std::shared_ptr<FlightResult> fr(new FlightResult());
+				fr->header = resp->header();
+				for (std::string r = resp->respond(); !r.empty(); r = resp->respond())
+					fr->body += r;
+				return std::shared_ptr<const FlightResult>(fr);
+			});
+			return new flight_responder(res);
+		}
+
+		return dispatch(req, fastcgi_req, user, ulimits);
+	}
+
+	// Serves an (authenticated) request
+	fcgi_responder* dispatch(web_req& req, FCGX_Request *fastcgi_req, const std::string &user,
+	                         RateLimiter::UserLimits *ulimits) {
 		RespFmt rfmt(getone(req.vars, "f", ""), getone(req.vars, "callback", ""));
 		std::string sreqid = getone(req.vars, "id", "");
 		uint64_t reqid = hexdecode64(sreqid);
+		std::string ltype = getone(req.vars, "type", "");
 
 		if (req.uri == "/rest/getMusicDirectory.view") {
 			std::list<Entity> entities;
@@ -160,14 +554,7 @@ private:
 			case TYPE_ARTIST: {
 				auto albums = model->getAlbumsByArtist(reqid);
 				for (auto album: albums) {
-					entities.push_back(Entity(rfmt, "child", {
-						{"id",       DS(album.sid()) },
-						{"title",    DS(album.title) },
-						{"artist",   DS(album.artist) },
-						{"parent",   DS(album.sartistid()) },
-						{"isDir",    DB(true) },
-						{"coverArt", album.hascover ? DS(album.sid()) : DN() }
-					}));
+					entities.push_back(Entity(rfmt, "child", album.getAttrs()));
 					tname = album.artist;
 				}
 				} break;
@@ -182,20 +569,29 @@ private:
 		         req.uri == "/rest/getAlbumList2.view") {
 			unsigned offset = atoi(getone(req.vars, "offset", "").c_str());
 			unsigned size = req.vars.count("size") ? atoi(getone(req.vars, "size", "").c_str()) : 10;
+			size = std::min(size, 500U);
+
+			std::list<Album> albums;
+			if (ltype == "random")
+				albums = model->getRandomAlbums(size);
+			else if (ltype == "newest")
+				albums = model->getAlbumsNewest(offset, size);
+			else if (ltype == "recent" || ltype == "frequent")
+				albums = model->getAlbums(udata->getPlayedAlbums(ltype == "recent", offset, size));
+			else if (ltype == "alphabeticalByArtist")
+				albums = model->getAlbumsSortedByArtist(offset, size);
+			else if (ltype == "byYear")
+				albums = model->getAlbumsByYear(atoi(getone(req.vars, "fromYear", "").c_str()),
+				                                atoi(getone(req.vars, "toYear", "").c_str()),
+				                                offset, size);
+			else if (ltype == "byGenre")
+				albums = model->getAlbumsByGenre(getone(req.vars, "genre", ""), offset, size);
+			else if (ltype != "starred" && ltype != "highest")  // No ratings/stars (yet)
+				albums = model->getAllAlbumsSorted(offset, size);
 
 			std::list<Entity> ealbums;
-			auto albums = model->getAllAlbumsSorted(offset, size);
-			for (auto album: albums) {
-				ealbums.push_back(Entity(rfmt, "album", {
-					{"id",       DS(album.sid())},
-					{"title",    DS(album.title)},
-					{"name",     DS(album.title)},
-					{"artist",   DS(album.artist)},
-					{"parent",   DS(album.sartistid())},
-					{"isDir",    DB(true)},
-					{"coverArt", album.hascover ? DS(album.sid()) : DN() }
-				}));
-			}
+			for (auto album: albums)
+				ealbums.push_back(Entity(rfmt, "album", album.getAttrs()));
 
 			std::string tag = (req.uri == "/rest/getAlbumList2.view") ? "albumList2" : "albumList";
 			return Entity::wrap(Entity(rfmt, tag, {}, ealbums)).respond();
@@ -203,17 +599,12 @@ private:
 		else if (req.uri == "/rest/getArtist.view") {
 			std::list<Entity> ealbums;
 			auto albums = model->getAlbumsByArtist(reqid);
-			for (auto album: albums) {
-				ealbums.push_back(Entity(rfmt, "album", {
-					{"id",       DS(album.sid())},
-					{"name",     DS(album.title)},
-					{"artist",   DS(album.artist)},
-					{"artistid", DS(album.sartistid()) },
-					{"coverArt", album.hascover ? DS(album.sid()) : DN() }
-				}));
-			}
+			for (auto album: albums)
+				ealbums.push_back(Entity(rfmt, "album", album.getAttrs()));
 
-			return Entity::wrap(Entity(rfmt, "artist", {{"albumCount", DI(albums.size())}}, ealbums)).respond();
+			Artist artist = model->getArtist(reqid);
+			artist.albumcount = albums.size();
+			return Entity::wrap(Entity(rfmt, "artist", artist.getAttrs(), ealbums)).respond();
 		}
 
 		else if (req.uri == "/rest/getAlbum.view") {
@@ -224,6 +615,10 @@ private:
 			                    {"name",      DS(alb.title)},
 			                    {"type",      DS("music")},
 			                    {"songCount", DI(songs.size())},
+			                    {"duration",  DI(alb.duration)},
+			                    {"year",      alb.year ? DI(alb.year) : DN()},
+			                    {"genre",     alb.genre.empty() ? DN() : DS(alb.genre)},
+			                    {"created",   alb.created ? DS(isotime(alb.created)) : DN()},
 			                    {"coverArt",  DS(sreqid)},
 			                    {"artist",    DS(alb.artist)},
 			                    {"artistId",  DS(alb.sartistid())}},
@@ -233,65 +628,133 @@ private:
 		else if (req.uri == "/rest/getRandomSongs.view") {
 			unsigned size = req.vars.count("size") ? atoi(getone(req.vars, "size", "").c_str()) : 10;
 
-			auto songs = model->getRandomSongs(size);
+			size = std::min(size, 500U);
+
+			auto songs = model->getRandomSongs(size, getone(req.vars, "genre", ""),
+			                                   atoi(getone(req.vars, "fromYear", "").c_str()),
+			                                   atoi(getone(req.vars, "toYear", "").c_str()));
 			std::list<Entity> esongs;
 			for (auto song: songs)
 				esongs.push_back(Entity(rfmt, "song", song.getAttrs()));
 
 			return Entity::wrap(Entity(rfmt, "randomSongs", {}, esongs)).respond();
 		}
-		else if (req.uri == "/rest/getArtists.view") {
-			std::list<Entity> eartists;
-			for (auto artist: model->getArtists())
-				eartists.push_back(Entity(rfmt, "artist",
-					{ {"id", DS(artist.sid())}, {"name", DS(artist.name)} }));
-
-			return Entity::wrap(Entity(rfmt, "artists", {
-			                    {"ignoredArticles", DS("The El La Los Las Le Les")}},
-					    std::list<Entity>{
-			                    Entity(rfmt, "index", {{"name", DS("Music")}}, eartists)})).respond();
-		}
-		else if (req.uri == "/rest/getIndexes.view") {
-			std::list<Entity> eartists;
-			for (auto artist: model->getArtists())
-				eartists.push_back(Entity(rfmt, "artist", 
-					{ {"id", DS(artist.sid())}, {"name", DS(artist.name)} }));
-
-			return Entity::wrap(Entity(rfmt, "indexes", {
-			                    {"lastModified", DI(1455843830000)},  // FIXME: Unix timestamp * 1000
-			                    {"ignoredArticles", DS("The El La Los Las Le Les")}},
-					    std::list<Entity>{
-			                    Entity(rfmt, "index", {{"name", DS("Music")}}, eartists)})).respond();
+		else if (req.uri == "/rest/search2.view" or
+		         req.uri == "/rest/search3.view") {
+			bool id3 = (req.uri == "/rest/search3.view");
+			std::string query = getone(req.vars, "query", "");
+			// Counts are capped to keep responses bounded, offsets are not
+			bool badarg = false;
+			auto getnum = [&req, &badarg] (const char *k, int def) {
+				int n = req.vars.count(k) ? atoi(getone(req.vars, k, "").c_str()) : def;
+				badarg |= (n < 0);
+				return (unsigned)std::max(n, 0);
+			};
+			auto getcnt = [&getnum] (const char *k) { return std::min(getnum(k, 20), 500U); };
+			unsigned artoff = getnum("artistOffset", 0), artcnt = getcnt("artistCount");
+			unsigned alboff = getnum("albumOffset", 0), albcnt = getcnt("albumCount");
+			unsigned songoff = getnum("songOffset", 0), songcnt = getcnt("songCount");
+			if (badarg)
+				return Entity::error(rfmt, 0, "Negative offset or count").respond();
+
+			std::list<Entity> results;
+			for (auto artist: model->searchArtists(query, artoff, artcnt))
+				results.push_back(Entity(rfmt, "artist", artist.getAttrs()));
+			for (auto album: model->searchAlbums(query, alboff, albcnt))
+				results.push_back(Entity(rfmt, "album", album.getAttrs()));
+			for (auto song: model->searchSongs(query, songoff, songcnt))
+				results.push_back(Entity(rfmt, "song", song.getAttrs()));
+
+			return Entity::wrap(Entity(rfmt, id3 ? "searchResult3" : "searchResult2", {},
+			                    results)).respond();
+		}
+		else if (req.uri == "/rest/search.view") {
+			// Legacy search, returns songs only
+			std::string query = getone(req.vars, "any", "");
+			for (auto k : {"artist", "album", "title"})
+				query += " " + getone(req.vars, k, "");
+			int offset = atoi(getone(req.vars, "offset", "").c_str());
+			int count = req.vars.count("count") ? atoi(getone(req.vars, "count", "").c_str()) : 20;
+			if (offset < 0 || count < 0)
+				return Entity::error(rfmt, 0, "Negative offset or count").respond();
+
+			std::list<Entity> esongs;
+			for (auto song: model->searchSongs(query, offset, std::min(count, 500)))
+				esongs.push_back(Entity(rfmt, "match", song.getAttrs()));
+
+			return Entity::wrap(Entity(rfmt, "searchResult", {
+			                    {"offset",    DI(offset)},
+			                    {"totalHits", DI(model->countSearchSongs(query))}},
+			                    esongs)).respond();
+		}
+		else if (req.uri == "/rest/getArtists.view" or
+		         req.uri == "/rest/getIndexes.view") {
+			bool id3 = (req.uri == "/rest/getArtists.view");
+			uint64_t lastmod = model->getLastModified();
+			Entity::FieldMap attrs = {{"ignoredArticles", DS(ignored_articles)}};
+			if (!id3)
+				attrs["lastModified"] = DI(lastmod);
+
+			// Nothing changed since the client last asked, no artists then
+			uint64_t ifmodsince = atoll(getone(req.vars, "ifModifiedSince", "").c_str());
+			if (lastmod && ifmodsince >= lastmod)
+				return Entity::wrap(Entity(rfmt, id3 ? "artists" : "indexes", attrs)).respond();
+
+			// Artists come sorted, group them by their (precomputed) index letter
+			std::vector<std::pair<std::string, std::list<Entity>>> buckets;
+			std::unordered_map<std::string, unsigned> bucketpos;
+			for (auto artist: model->getArtists()) {
+				std::string letter = artist.index.empty() ? "#" : artist.index;
+				if (!bucketpos.count(letter)) {
+					bucketpos[letter] = buckets.size();
+					buckets.push_back({letter, {}});
+				}
+				buckets[bucketpos[letter]].second.push_back(Entity(rfmt, "artist", artist.getAttrs()));
+			}
+
+			std::list<Entity> eindexes;
+			for (const auto & b : buckets)
+				eindexes.push_back(Entity(rfmt, "index", {{"name", DS(b.first)}}, b.second));
+
+			return Entity::wrap(Entity(rfmt, id3 ? "artists" : "indexes", attrs, eindexes)).respond();
 		}
 		else if (req.uri == "/rest/stream.view" or
 		         req.uri == "/rest/download.view") {
-			// Lookup song_id and get a file name!
-			std::string fname = model->getSongFile(reqid);
-			if (!fname.empty()) {
-				FILE *fd = NULL;
-				if (fname[0] == '/')
-					// Use absolute path as is
-					fd = fopen(fname.c_str(), "rb");
-				else {
-					// Try to open the file using all the search paths
-					for (const auto & dir : sdirs) {
-						fd = fopen((dir + "/" + fname).c_str(), "rb");
-						if (fd)
-							break;
-					}
-				}
-				// Stream the data to the user if found
-				if (fd) {
-					// Easier to count this way, prevent overflow
-					req.lastbyte = std::max(req.lastbyte, req.lastbyte + 1);
-					uint64_t fsz = fsize(fd);
-					if (req.lastbyte > fsz)
-						req.lastbyte = fsz;
-
-					if (req.lastbyte > req.offset)
-						return new stream_responder(fd, req.offset, req.lastbyte - req.offset);
-					fclose(fd);
+			bool newplay;
+
+			// Seeking by time (timeOffset is in seconds) uses the song seek table
+			uint64_t seekoff = 0, prefix = 0;
+			uint64_t timeoffset = atoll(getone(req.vars, "timeOffset", "").c_str());
+			if (timeoffset && req.uri == "/rest/stream.view")
+				seekoff = model->getSongSeekOffset(reqid, timeoffset * 1000, &prefix);
+
+			// HEAD is answered using the scanned file size, no need to open it
+			uint64_t filesize = 0, mtime = 0;
+			if (req.method == "HEAD" && !model->getSongFile(reqid, &filesize, &mtime).empty() && filesize)
+				return streamFile(req, nullptr, filesize, mtime, seekoff, prefix, 0, nullptr, &newplay);
+
+			// Pace the stream at a multiple of the song bitrate (kbps)
+			std::unique_ptr<Song> song;
+			uint64_t rate = 0;
+			if (pacing > 0 && (song = model->getSong(reqid)))
+				rate = song->bitRate * 125 * pacing;
+
+			// Stream the data to the user if found
+			auto file = open_song(model, files, sdirs, reqid);
+			if (file) {
+				auto resp = streamFile(req, file, file->size, file->mtime, seekoff, prefix, rate,
+				                       limiter->limitBytes() ? &ulimits->bytes : nullptr, &newplay);
+
+				// Count album plays when a song is started from the beginning
+				// (HEAD requests that could not be answered above never play)
+				if (newplay && req.uri == "/rest/stream.view" && req.method != "HEAD") {
+					if (!song)
+						song = model->getSong(reqid);
+					if (song)
+						udata->recordPlay(song->albumid);
+					prefetch->played(user, reqid);
 				}
+				return resp;
 			}
 		}
 
@@ -339,6 +802,13 @@ private:
 					albumid = song->albumid;
 			}
 			unsigned size = atoi(getone(req.vars, "size", "").c_str());
+			if (req.method == "HEAD") {
+				uint64_t imgsize;
+				model->getAlbumCover(albumid, size, &imgsize);
+				return new str_resp("Status: 200\r\n"
+					"Content-Type: image/jpeg\r\n"
+					"Content-Length: " + std::to_string(imgsize) + "\r\n", "");
+			}
 			std::string img = model->getAlbumCover(albumid, size);
 			return new str_resp("Status: 200\r\n"
 				"Content-Type: image/jpeg\r\n"
@@ -347,21 +817,20 @@ private:
 		// Playlist management
 		// getPlaylists getPlaylist createPlaylist updatePlaylist deletePlaylist 
 		else if (req.uri == "/rest/getPlaylist.view") {
-			auto pl = udata->getPlaylist(reqid);
+			auto pl = udata->getPlaylist(atoll(sreqid.c_str()));
 			if (pl) {
 				if (pl->upublic || pl->username == user) {
+					prefetch->setPlaylist(user, pl->songs);
 					std::list<Entity> esongs;
-					for (auto songid : pl->songs) {
-						auto song = model->getSong(songid);
-						esongs.push_back(Entity(rfmt, "entry", song->getAttrs()));
-					}
+					for (const auto & song : model->getSongs(pl->songs))
+						esongs.push_back(Entity(rfmt, "entry", song.getAttrs()));
 					return Entity::wrap(Entity(rfmt, "playlist", {
-					                    {"id",        DS(std::to_string(reqid))},
+					                    {"id",        DS(std::to_string(pl->id))},
 					                    {"name",      DS(pl->name)},
 					                    {"comment",   DS(pl->comment)},
 					                    {"owner",     DS(pl->username)},
 					                    {"public",    DB(pl->upublic)},
-					                    {"songCount", DI(pl->songs.size())}},
+					                    {"songCount", DI(esongs.size())}},
 					                    esongs)).respond();
 				}
 				else
@@ -373,16 +842,71 @@ private:
 		else if (req.uri == "/rest/getPlaylists.view") {
 			std::list<Entity> eplaylists;
 			for (const auto & pl : udata->getPlaylists(user)) {
-				eplaylists.push_back(Entity::wrap(Entity(rfmt, "playlist", {
-				                    {"id",        DS(std::to_string(reqid))},
+				eplaylists.push_back(Entity(rfmt, "playlist", {
+				                    {"id",        DS(std::to_string(pl.id))},
 				                    {"name",      DS(pl.name)},
 				                    {"comment",   DS(pl.comment)},
 				                    {"owner",     DS(pl.username)},
 				                    {"public",    DB(pl.upublic)},
-				                    {"songCount", DI(pl.songs.size())}})));
+				                    {"songCount", DI(pl.songcount)}}));
 			}
 			return Entity::wrap(Entity(rfmt, "playlists", {}, eplaylists)).respond();
 		}
+		else if (req.uri == "/rest/createPlaylist.view" or
+		         req.uri == "/rest/updatePlaylist.view" or
+		         req.uri == "/rest/deletePlaylist.view") {
+			// Playlist ID comes in different args depending on the call
+			std::string spid = req.uri == "/rest/deletePlaylist.view" ? sreqid :
+			                   getone(req.vars, "playlistId", "");
+			uint64_t pid = atoll(spid.c_str());
+			if (!spid.empty()) {
+				auto pl = udata->getPlaylist(pid);
+				if (!pl)
+					return Entity::error(rfmt, 70, "Playlist not found").respond();
+				if (pl->username != user)
+					return Entity::error(rfmt, 50, "Permission denied").respond();
+			}
+
+			auto getall = [&req] (const char *k) {
+				std::vector<uint64_t> ret;
+				auto r = req.vars.equal_range(k);
+				for (auto it = r.first; it != r.second; ++it)
+					ret.push_back(hexdecode64(it->second));
+				return ret;
+			};
+
+			if (req.uri == "/rest/createPlaylist.view") {
+				if (spid.empty())
+					udata->createPlaylist(user, getone(req.vars, "name", ""), getall("songId"));
+				else
+					udata->setPlaylistSongs(pid, getall("songId"));
+			}
+			else if (req.uri == "/rest/updatePlaylist.view") {
+				if (spid.empty())
+					return Entity::error(rfmt, 10, "Missing playlistId").respond();
+
+				std::vector<unsigned> toremove;
+				auto r = req.vars.equal_range("songIndexToRemove");
+				for (auto it = r.first; it != r.second; ++it)
+					toremove.push_back(atoi(it->second.c_str()));
+
+				auto nameit = req.vars.find("name");
+				auto commit = req.vars.find("comment");
+				auto pubit = req.vars.find("public");
+				bool upublic = pubit != req.vars.end() && pubit->second == "true";
+				udata->updatePlaylist(pid,
+					nameit != req.vars.end() ? &nameit->second : nullptr,
+					commit != req.vars.end() ? &commit->second : nullptr,
+					pubit != req.vars.end() ? &upublic : nullptr,
+					getall("songIdToAdd"), toremove);
+			}
+			else {
+				if (spid.empty())
+					return Entity::error(rfmt, 10, "Missing id").respond();
+				udata->deletePlaylist(pid);
+			}
+			return Entity::wrap(rfmt).respond();
+		}
 
 		// All the unsupported features, like podcasts & video calls are mocked out here.
 		// Denies permissions to all updates and returns empty yet valid responses to all queries
@@ -428,53 +952,136 @@ private:
 
 public:
 	SupersonicServer(DataModel *dbm, UserData *udata,
-	                 ConcurrentQueue<std::unique_ptr<FCGX_Request>> *rq,
-	                 std::vector<std::string> sdirs, std::string cors_origin)
-	: model(dbm), udata(udata), rq(rq), sdirs(sdirs), cors_origin(cors_origin) {
+	                 ReqPool *pool,
+	                 std::vector<std::string> sdirs, FileCache *files,
+	                 Prefetcher *prefetch, IOPool *io, double pacing, TimerWheel *wheel,
+	                 RateLimiter *limiter, std::string cors_origin)
+	: model(dbm), udata(udata), pool(pool), sdirs(sdirs), files(files), prefetch(prefetch),
+	  io(io), pacing(pacing), wheel(wheel), limiter(limiter), cors_origin(cors_origin) {
 		cthread = std::thread(&SupersonicServer::work, this);
 	}
 
+	static std::string coalesceStats() {
+		return "coalesced requests: " + std::to_string(inflight.getCoalesced());
+	}
+
 	~SupersonicServer() {
 		cthread.join();
 	}
 
 	// Receives requests and processes them by replying via a side http call.
 	void work() {
-		std::unique_ptr<FCGX_Request> req;
-		while (rq->pop(&req)) {
-			// Get streams to write
-			fcgi_streambuf reqout(req->out);
-			std::iostream obuf(&reqout);
-
-			// Parse inputs
-			web_req wreq;
-			wreq.method   = FCGX_GetParam("REQUEST_METHOD", req->envp) ?: "";
-			wreq.uri      = FCGX_GetParam("DOCUMENT_URI", req->envp) ?: "";
-			wreq.vars     = parse_vars(FCGX_GetParam("QUERY_STRING", req->envp) ?: "");
-			wreq.host     = FCGX_GetParam("HTTP_HOST", req->envp) ?: "";
-			std::tie(wreq.offset, wreq.lastbyte) = parse_range(FCGX_GetParam("HTTP_RANGE", req->envp) ?: "");
-
-			std::unique_ptr<fcgi_responder> resp(this->handle(wreq, req.get()));
-
-			// Respond with an immediate update JSON encoded too
-			obuf << resp->header();  // Send header
-			if (!cors_origin.empty())
-				obuf << "Access-Control-Allow-Origin: " + cors_origin + "\r\n";
-			obuf << "\r\n";
-			while (wreq.method != "HEAD") {
-				std::string r = resp->respond();
-				// Stop if EOF or there was a write error (pipe broken most likely)
-				if (r.empty() || FCGX_GetError(req->out))
-					break;
-				obuf << r;
+		PoolJob job;
+		while (pool->pop(&job)) {
+			if (!job.resp)
+				start(&job);
+
+			// Park the job if its responder has to wait, it comes back later
+			if (!job.head && !sendBody(&job)) {
+				pool->park();
+				continue;
+			}
+
+			FCGX_Finish_r(job.req.get());
+			job = PoolJob();
+			pool->done();
+		}
+	}
+
+	// Parses and handles a new request, sending the response headers
+	void start(PoolJob *job) {
+		FCGX_Request *req = job->req.get();
+		fcgi_streambuf reqout(req->out);
+		std::iostream obuf(&reqout);
+
+		// Parse inputs
+		web_req wreq;
+		wreq.method   = FCGX_GetParam("REQUEST_METHOD", req->envp) ?: "";
+		wreq.uri      = FCGX_GetParam("DOCUMENT_URI", req->envp) ?: "";
+		wreq.vars     = parse_vars(FCGX_GetParam("QUERY_STRING", req->envp) ?: "");
+		wreq.host     = FCGX_GetParam("HTTP_HOST", req->envp) ?: "";
+		wreq.range    = FCGX_GetParam("HTTP_RANGE", req->envp) ?: "";
+		wreq.ifrange  = FCGX_GetParam("HTTP_IF_RANGE", req->envp) ?: "";
+		wreq.ifnonematch     = FCGX_GetParam("HTTP_IF_NONE_MATCH", req->envp) ?: "";
+		wreq.ifmodifiedsince = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", req->envp) ?: "";
+
+		job->resp.reset(this->handle(wreq, req));
+		job->head = (wreq.method == "HEAD");
+		std::string header = job->resp->header();
+		bool ok = header.compare(0, 12, "Status: 200\r") == 0;
+		if (!wreq.headkey.empty() && ok)
+			storeHead(wreq, header);
+
+		// Respond with an immediate update JSON encoded too
+		obuf << header;  // Send header
+		// Validators describe the resource, not errors (304s must repeat them)
+		if (ok || header.compare(0, 12, "Status: 304\r") == 0)
+			obuf << wreq.extra_headers;
+		if (!cors_origin.empty())
+			obuf << "Access-Control-Allow-Origin: " + cors_origin + "\r\n";
+		obuf << "\r\n";
+	}
+
+	// Sends the response body until it's over (returns true) or the responder
+	// has to wait. The job is then handed to the timer wheel, which queues it
+	// in the pool again once it can go on (returns false).
+	bool sendBody(PoolJob *job) {
+		fcgi_streambuf reqout(job->req->out);
+		std::iostream obuf(&reqout);
+		while (true) {
+			uint64_t wait = job->resp->wait();
+			if (wait) {
+				// Whatever was written should reach the client meanwhile
+				obuf.flush();
+				FCGX_FFlush(job->req->out);
+				std::shared_ptr<PoolJob> parked(new PoolJob(std::move(*job)));
+				ReqPool *p = pool;
+				wheel->schedule(TimerWheel::clock::now() + std::chrono::nanoseconds(wait),
+					[p, parked] {
+						std::string user = parked->user;   // The job is moved away
+						p->resume(user, *parked);
+					});
+				return false;
 			}
 
-			FCGX_Finish_r(req.get());
-			req.reset();
+			std::string r = job->resp->respond();
+			// Stop if EOF or there was a write error (pipe broken most likely)
+			if (r.empty() || FCGX_GetError(job->req->out))
+				return true;
+			obuf << r;
 		}
 	}
 };
 
+time_t SupersonicServer::boot_time = time(NULL);
+std::mutex SupersonicServer::headmutex;
+std::unordered_map<std::string, std::pair<std::string, std::string>> SupersonicServer::headcache;
+SingleFlight<std::shared_ptr<const SupersonicServer::FlightResult>> SupersonicServer::inflight;
+
+// Request classes, each one served by its own worker pool
+enum ReqClass { CLASS_API, CLASS_COVER, CLASS_STREAM, NUM_CLASSES };
+
+// Gets the (unauthenticated) user name from a query string, for scheduling
+static std::string request_user(const char *qs) {
+	std::string user;
+	if (qs)
+		tokenize_vars(qs, strlen(qs), [&user] (const char *k, size_t kl, const char *v, size_t vl) {
+			if (kl == 1 && k[0] == 'u')
+				user = urldec(v, vl);
+		});
+	return user;
+}
+
+static ReqClass classify(const char *uri) {
+	if (!uri)
+		return CLASS_API;
+	if (!strcmp(uri, "/rest/stream.view") || !strcmp(uri, "/rest/download.view"))
+		return CLASS_STREAM;
+	if (!strcmp(uri, "/rest/getCoverArt.view"))
+		return CLASS_COVER;
+	return CLASS_API;
+}
+
 bool serving = true;
 void sighandler(int) {
 	std::cerr << "Signal caught" << std::endl;
@@ -493,6 +1100,16 @@ int main(int argc, char **argv) {
 	parser.addArgument("-t", "--threads", 1, true);
 	parser.addArgument("-d", "--search-dir", '*');
 	parser.addArgument("-c", "--access-control-origin", 1, true);
+	parser.addArgument("-o", "--open-files", 1, true);
+	parser.addArgument("-k", "--chunk-cache-mb", 1, true);
+	parser.addArgument("-p", "--prefetch", 1, true);
+	parser.addArgument("-i", "--io-threads", 1, true);
+	parser.addArgument("-b", "--pace", 1, true);
+	parser.addArgument("-r", "--user-requests-per-sec", 1, true);
+	parser.addArgument("-w", "--user-stream-kbps", 1, true);
+	parser.addArgument("-C", "--cover-threads", 1, true);
+	parser.addArgument("-S", "--stream-threads", 1, true);
+	parser.addArgument("-q", "--max-queued", 1, true);
 	parser.parse(argc, (const char **)argv);
 
 	// Initialize the database backend.
@@ -533,6 +1150,19 @@ int main(int argc, char **argv) {
 	if (sdirs.empty())
 		sdirs.push_back("/");     // Assuming aboslute paths in the database
 
+	// Keep some song files open, hot songs are then streamed with no open()
+	unsigned openfiles = parser.count("o") ? atoi(parser.retrieve<std::string>("o").c_str()) : 64;
+	FileCache files(openfiles, 16384);
+
+	// Memory used to cache song contents shared by concurrent listeners
+	int chunkmb = parser.count("k") ? atoi(parser.retrieve<std::string>("k").c_str()) : 64;
+	uint64_t chunkbytes = chunkmb > 0 ? (uint64_t)chunkmb << 20 : 0;
+	if (chunkbytes && chunkbytes < ChunkCache::min_bytes) {
+		chunkbytes = ChunkCache::min_bytes;
+		std::cerr << "Chunk cache raised to its minimum size (" << (chunkbytes >> 20) << "MB)" << std::endl;
+	}
+	ChunkCache chunks(chunkbytes);
+
 	// Start FastCGI interface
 	FCGX_Init();
 
@@ -541,15 +1171,84 @@ int main(int argc, char **argv) {
 	signal(SIGTERM, sighandler);
 	signal(SIGPIPE, SIG_IGN);
 
-	// Start worker threads for this
-	unsigned nthreads = parser.count("t") ? atoi(parser.retrieve<std::string>("t").c_str()) : 4;
+	// SIGUSR1 dumps stats, it's only handled by the stats thread
+	sigset_t statsig;
+	sigemptyset(&statsig);
+	sigaddset(&statsig, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &statsig, NULL);
+
 	DataModel dbm(sqldb);
-	ConcurrentQueue<std::unique_ptr<FCGX_Request>> reqqueue;
-	SupersonicServer *workers[nthreads];
-	for (unsigned i = 0; i < nthreads; i++)
-		workers[i] = new SupersonicServer(&dbm, &udata, &reqqueue, sdirs, cors_origin);
+	auto missing = dbm.missingSchema();
+	if (!missing.empty()) {
+		std::cerr << "The music database schema is outdated, re-run the scanner on it "
+		             "to upgrade it. Missing:";
+		for (const auto & m : missing)
+			std::cerr << " " << m;
+		std::cerr << std::endl;
+		return 1;
+	}
+
+	// Next song prefetching, enabled unless "--prefetch 0"
+	bool prefetch_on = !parser.count("p") || atoi(parser.retrieve<std::string>("p").c_str());
+	Prefetcher prefetch(&dbm, &chunks, [&dbm, &files, sdirs] (uint64_t id) {
+		return open_song(&dbm, &files, sdirs, id);
+	}, prefetch_on);
+
+	// Threads reading song data ahead of the workers (0 reads synchronously)
+	unsigned iothreads = parser.count("i") ? atoi(parser.retrieve<std::string>("i").c_str()) : 4;
+	IOPool iopool(&chunks, iothreads);
+
+	// Optional stream pacing (ie. "--pace 1.5" sends at 1.5x the song bitrate)
+	double pacing = parser.count("b") ? atof(parser.retrieve<std::string>("b").c_str()) : 0;
+	TimerWheel wheel;
+
+	// Per user limits (unlimited by default)
+	double userrps = parser.count("r") ? atof(parser.retrieve<std::string>("r").c_str()) : 0;
+	double userkbps = parser.count("w") ? atof(parser.retrieve<std::string>("w").c_str()) : 0;
+	RateLimiter limiter(userrps, userkbps * 125);
 
-	std::cerr << "All workers up, serving until SIGINT/SIGTERM" << std::endl;
+	// Start worker threads for each request class
+	auto numarg = [&parser] (const char *name, unsigned def) -> unsigned {
+		return parser.count(name) ? atoi(parser.retrieve<std::string>(name).c_str()) : def;
+	};
+	// Pool sizes are given as "threads[:maxqueued]", -q being the default queue limit
+	unsigned maxqueued = numarg("q", 256);
+	auto newpool = [&parser, maxqueued] (const char *pname, const char *name, unsigned def) {
+		unsigned nthreads = def, queue = maxqueued;
+		if (parser.count(name)) {
+			std::string spec = parser.retrieve<std::string>(name);
+			nthreads = atoi(spec.c_str());
+			size_t c = spec.find(':');
+			if (c != std::string::npos)
+				queue = atoi(&spec[c+1]);
+		}
+		return std::unique_ptr<ReqPool>(new ReqPool(pname, nthreads, queue));
+	};
+	std::unique_ptr<ReqPool> pools[NUM_CLASSES] = {
+		newpool("api", "t", 4),
+		newpool("cover", "C", 2),
+		newpool("stream", "S", 8),
+	};
+	std::vector<SupersonicServer*> workers;
+	for (auto & pool : pools)
+		for (unsigned i = 0; i < pool->threads(); i++)
+			workers.push_back(new SupersonicServer(&dbm, &udata, pool.get(), sdirs, &files,
+			                  &prefetch, &iopool, pacing, &wheel, &limiter, cors_origin));
+
+	auto dumpstats = [&] () {
+		for (auto & pool : pools)
+			std::cerr << pool->stats() << std::endl;
+		std::cerr << chunks.stats() << std::endl;
+		std::cerr << prefetch.stats() << std::endl;
+		std::cerr << SupersonicServer::coalesceStats() << std::endl;
+	};
+	std::thread statsthread([&] () {
+		int sig;
+		while (!sigwait(&statsig, &sig) && serving)
+			dumpstats();
+	});
+
+	std::cerr << "All workers up, serving until SIGINT/SIGTERM (SIGUSR1 dumps stats)" << std::endl;
 
 	// Now keep ingesting incoming requests, we do this in the main
 	// thread since threads are much slower, unlikely to be a bottleneck.
@@ -557,18 +1256,39 @@ int main(int argc, char **argv) {
 		std::unique_ptr<FCGX_Request> request(new FCGX_Request());
 		FCGX_InitRequest(request.get(), 0, 0);
 
-		if (FCGX_Accept_r(request.get()) >= 0)
-			// Get a worker that's free and queue it there
-			reqqueue.push(std::move(request));
+		if (FCGX_Accept_r(request.get()) >= 0) {
+			// Queue it in the pool for its class, unless it's too busy
+			auto & pool = pools[classify(FCGX_GetParam("DOCUMENT_URI", request->envp))];
+			std::string user = request_user(FCGX_GetParam("QUERY_STRING", request->envp));
+			PoolJob job;
+			job.user = user;
+			job.req = std::move(request);
+			if (!pool->push(user, job)) {
+				request = std::move(job.req);
+				fcgi_streambuf reqout(request->out);
+				std::iostream obuf(&reqout);
+				obuf << "Status: 503\r\n"
+				        "Retry-After: 1\r\n"
+				        "Content-Type: text/plain\r\n"
+				        "Content-Length: 11\r\n\r\nServer busy";
+				obuf.flush();
+				FCGX_Finish_r(request.get());
+			}
+		}
 	}
 
 	std::cerr << "Signal caught! Starting shutdown" << std::endl;
-	reqqueue.close();
+	for (auto & pool : pools)
+		pool->close();
 
-	// Just go ahead and delete workers
-	for (unsigned i = 0; i < nthreads; i++)
-		delete workers[i];
+	// Just go ahead and delete workers, parked streams are dropped
+	for (auto w : workers)
+		delete w;
+	wheel.stop();
+	pthread_kill(statsthread.native_handle(), SIGUSR1);
+	statsthread.join();
 
+	dumpstats();
 	std::cerr << "All clear, service is down, flushing databases ..." << std::endl;
 	sqlite3_close(sqldb);
 }
@@ -0,0 +1,94 @@
+#ifndef _TIMERWHEEL__H__
+#define _TIMERWHEEL__H__
+
+#include <list>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <stdint.h>
+
+// Hashed timer wheel driven by a single thread. Work that has to wait (ie.
+// paced or throttled streams) is parked in the slot of its deadline tick as a
+// callback, run by the wheel thread when due, instead of each one running its
+// own timer (or holding a thread while it waits).
+class TimerWheel {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	TimerWheel(unsigned tickms = 10, unsigned nslots = 256)
+	  : tick(tickms), slots(nslots), start(clock::now()), curtick(0), end(false) {
+		wthread = std::thread(&TimerWheel::work, this);
+	}
+
+	~TimerWheel() {
+		stop();
+	}
+
+	// Stops the wheel thread, pending callbacks are dropped without running
+	void stop() {
+		std::unique_lock<std::mutex> lock(mu);
+		if (end)
+			return;
+		end = true;
+		lock.unlock();
+		wthread.join();
+	}
+
+	// Runs fn at "when" (rounded up to the wheel tick, and never before the
+	// next one) in the wheel thread, so it must be quick.
+	void schedule(clock::time_point when, std::function<void()> fn) {
+		uint64_t wtick = when > start ? (when - start + tick - clock::duration(1)) / tick : 0;
+		std::lock_guard<std::mutex> g(mu);
+		if (end)
+			return;
+		wtick = std::max(wtick, curtick + 1);
+		slots[wtick % slots.size()].push_back(Timer{wtick, std::move(fn)});
+	}
+
+private:
+	struct Timer {
+		uint64_t tick;
+		std::function<void()> fn;
+	};
+
+	void work() {
+		std::unique_lock<std::mutex> lock(mu);
+		while (!end) {
+			lock.unlock();
+			std::this_thread::sleep_until(start + tick * (curtick + 1));
+			lock.lock();
+			curtick++;
+
+			// Take the timers due, the rest are in a later wheel round. They
+			// run without holding the lock, so they can schedule again.
+			std::vector<std::function<void()>> due;
+			auto & slot = slots[curtick % slots.size()];
+			for (auto it = slot.begin(); it != slot.end(); ) {
+				if (it->tick <= curtick) {
+					due.push_back(std::move(it->fn));
+					it = slot.erase(it);
+				}
+				else
+					++it;
+			}
+			lock.unlock();
+			for (auto & fn : due)
+				fn();
+			lock.lock();
+		}
+	}
+
+	const std::chrono::milliseconds tick;
+	std::vector<std::list<Timer>> slots;
+	const clock::time_point start;
+	uint64_t curtick;
+	bool end;
+	std::mutex mu;
+	std::thread wthread;
+};
+
+#endif
+
@@ -1,4 +1,6 @@
 
+#include <time.h>
+#include <algorithm>
 #include "userdata.h"
 #include "datamodel.h"
 #include "util.h"
@@ -7,7 +9,7 @@
 // Intializes all the tables required for this to work
 
 static const char * init_sql = "\
-	CREATE TABLE `playlists` (\
+	CREATE TABLE IF NOT EXISTS `playlists` (\
 		`id`       INTEGER NOT NULL UNIQUE PRIMARY KEY AUTOINCREMENT,\
 		`user`     TEXT NOT NULL,\
 		`name`     TEXT,\
@@ -15,69 +17,234 @@ static const char * init_sql = "\
 		`public`   INTEGER,\
 		`songs`    BLOB\
 	);\
+	CREATE TABLE IF NOT EXISTS `playlist_entries` (\
+		`playlistid` INTEGER NOT NULL,\
+		`position`   INTEGER NOT NULL,\
+		`songid`     INTEGER NOT NULL,\
+		PRIMARY KEY(`playlistid`, `position`)\
+	) WITHOUT ROWID;\
+	CREATE TABLE IF NOT EXISTS `albumplays` (\
+		`albumid`    INTEGER NOT NULL UNIQUE PRIMARY KEY,\
+		`playcount`  INTEGER NOT NULL,\
+		`lastplayed` INTEGER NOT NULL\
+	);\
+	CREATE INDEX IF NOT EXISTS `albumplays_count` ON `albumplays` (`playcount`);\
+	CREATE INDEX IF NOT EXISTS `albumplays_last` ON `albumplays` (`lastplayed`);\
 ";
 
 PlayList::PlayList(sqlite3_stmt * stmt) {
-	id       = sqlite3_column_int64 (stmt, 0);
-	name     = std::string((char*)sqlite3_column_text (stmt, 1));
-	comment  = std::string((char*)sqlite3_column_text (stmt, 2));
-	username = std::string((char*)sqlite3_column_text (stmt, 3));
-	upublic  = sqlite3_column_int64 (stmt, 4);
-
-	auto length = sqlite3_column_bytes(stmt, 5);
-	songs.reserve(length / 8);
-	std::string data((char*)sqlite3_column_blob(stmt, 5), length);
-	for (unsigned i = 0; i < length / 8U; i++)
-		songs.push_back(a2i64((uint8_t*)&data[i * 8]));
+	id        = sqlite3_column_int64 (stmt, 0);
+	name      = std::string((char*)sqlite3_column_text (stmt, 1) ?: "");
+	comment   = std::string((char*)sqlite3_column_text (stmt, 2) ?: "");
+	username  = std::string((char*)sqlite3_column_text (stmt, 3));
+	upublic   = sqlite3_column_int64 (stmt, 4);
+	songcount = sqlite3_column_int (stmt, 5);
+}
+
+UserData::UserData(sqlite3 *db) : generation(0), lastwrite(time(NULL)) {
+	// Run initial statements just in case, this should be a no-op if already there.
+	sqlite3_exec(db, init_sql, NULL, NULL, NULL);
+
+	this->dbh = db;
+	migratePlaylists();
+}
+
+UserData::~UserData() {
+	sqlite3_close(dbh);
+}
+
+// Moves songs from the old packed BLOB column into playlist_entries
+void UserData::migratePlaylists() {
+	std::lock_guard<std::mutex> g(dbmutex);
+	sqlite3_exec(dbh, "BEGIN", NULL, NULL, NULL);
+
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(dbh, "SELECT `id`, songs FROM playlists WHERE length(songs) > 0",
+	                   -1, &stmt, NULL);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		auto length = sqlite3_column_bytes(stmt, 1);
+		const uint8_t *data = (const uint8_t*)sqlite3_column_blob(stmt, 1);
+		std::vector<uint64_t> songs;
+		for (unsigned i = 0; i < length / 8U; i++)
+			songs.push_back(a2i64(&data[i * 8]));
+		appendSongs(sqlite3_column_int64(stmt, 0), songs);
+	}
+	sqlite3_finalize(stmt);
+
+	sqlite3_exec(dbh, "UPDATE playlists SET songs = NULL", NULL, NULL, NULL);
+	sqlite3_exec(dbh, "COMMIT", NULL, NULL, NULL);
 }
 
-void PlayList::flush(sqlite3 *db) const {
+// Adds songs at the end of the playlist. Positions can have gaps (after
+// removals), only their order matters.
+void UserData::appendSongs(uint64_t pid, const std::vector<uint64_t> &songs) {
+	if (songs.empty())
+		return;
+
 	sqlite3_stmt *stmt;
-	sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO playlists "
-	                   "`id`, name, comment, user, public, songs VALUES "
-	                   "(?, ?, ?, ?, ?, ?)", -1, &stmt, NULL);
-	sqlite3_bind_int64(stmt, 1, id);
-	sqlite3_bind_text (stmt, 2, name.c_str(), -1, NULL);
-	sqlite3_bind_text (stmt, 3, comment.c_str(), -1, NULL);
-	sqlite3_bind_text (stmt, 4, username.c_str(), -1, NULL);
-	sqlite3_bind_int64(stmt, 5, upublic ? 1 : 0);
-
-	std::string data; data.reserve(songs.size() * sizeof(uint64_t));
-	for (auto s : songs)
-		data += i642a(s);
-	sqlite3_bind_blob(stmt, 6, data.c_str(), data.size(), NULL);
+	sqlite3_prepare_v2(dbh, "SELECT max(position) FROM playlist_entries WHERE playlistid = ?",
+	                   -1, &stmt, NULL);
+	sqlite3_bind_int64(stmt, 1, pid);
+	int64_t pos = 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+		pos = sqlite3_column_int64(stmt, 0) + 1;
+	sqlite3_finalize(stmt);
+
+	sqlite3_prepare_v2(dbh, "INSERT INTO playlist_entries (playlistid, position, songid) "
+	                   "VALUES (?, ?, ?)", -1, &stmt, NULL);
+	for (auto songid : songs) {
+		sqlite3_bind_int64(stmt, 1, pid);
+		sqlite3_bind_int64(stmt, 2, pos++);
+		sqlite3_bind_int64(stmt, 3, songid);
+		sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+}
+
+void UserData::bumpGeneration() {
+	generation++;
+	lastwrite = time(NULL);
+}
+
+uint64_t UserData::createPlaylist(std::string user, std::string name,
+                                  const std::vector<uint64_t> &songs) {
+	std::lock_guard<std::mutex> g(dbmutex);
+	sqlite3_exec(dbh, "BEGIN", NULL, NULL, NULL);
 
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(dbh, "INSERT INTO playlists (user, name, comment, public) "
+	                   "VALUES (?, ?, '', 0)", -1, &stmt, NULL);
+	sqlite3_bind_text(stmt, 1, user.c_str(), -1, NULL);
+	sqlite3_bind_text(stmt, 2, name.c_str(), -1, NULL);
 	sqlite3_step(stmt);
 	sqlite3_finalize(stmt);
+
+	uint64_t pid = sqlite3_last_insert_rowid(dbh);
+	appendSongs(pid, songs);
+
+	sqlite3_exec(dbh, "COMMIT", NULL, NULL, NULL);
+	bumpGeneration();
+	return pid;
 }
 
-UserData::UserData(sqlite3 *db) {
-	// Run initial statements just in case, this should be a no-op if already there.
-	sqlite3_exec(db, init_sql, NULL, NULL, NULL);
+void UserData::setPlaylistSongs(uint64_t pid, const std::vector<uint64_t> &songs) {
+	std::lock_guard<std::mutex> g(dbmutex);
+	sqlite3_exec(dbh, "BEGIN", NULL, NULL, NULL);
 
-	this->dbh = db;
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(dbh, "DELETE FROM playlist_entries WHERE playlistid = ?", -1, &stmt, NULL);
+	sqlite3_bind_int64(stmt, 1, pid);
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	appendSongs(pid, songs);
+
+	sqlite3_exec(dbh, "COMMIT", NULL, NULL, NULL);
+	bumpGeneration();
 }
 
-UserData::~UserData() {
-	sqlite3_close(dbh);
+void UserData::updatePlaylist(uint64_t pid, const std::string *name, const std::string *comment,
+                              const bool *upublic, const std::vector<uint64_t> &songstoadd,
+                              std::vector<unsigned> indextoremove) {
+	std::lock_guard<std::mutex> g(dbmutex);
+	sqlite3_exec(dbh, "BEGIN", NULL, NULL, NULL);
+
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(dbh, "UPDATE playlists SET name = coalesce(?, name), "
+	                   "comment = coalesce(?, comment), public = coalesce(?, public) "
+	                   "WHERE `id` = ?", -1, &stmt, NULL);
+	if (name)
+		sqlite3_bind_text(stmt, 1, name->c_str(), -1, NULL);
+	if (comment)
+		sqlite3_bind_text(stmt, 2, comment->c_str(), -1, NULL);
+	if (upublic)
+		sqlite3_bind_int(stmt, 3, *upublic ? 1 : 0);
+	sqlite3_bind_int64(stmt, 4, pid);
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	// Resolve all indexes to positions first, since they refer to the original
+	// list. A single ordered walk, stopping past the highest index.
+	std::sort(indextoremove.begin(), indextoremove.end());
+	indextoremove.erase(std::unique(indextoremove.begin(), indextoremove.end()), indextoremove.end());
+	std::vector<int64_t> positions;
+	if (!indextoremove.empty()) {
+		sqlite3_prepare_v2(dbh, "SELECT position FROM playlist_entries WHERE playlistid = ? "
+		                   "ORDER BY position LIMIT ?", -1, &stmt, NULL);
+		sqlite3_bind_int64(stmt, 1, pid);
+		sqlite3_bind_int64(stmt, 2, (int64_t)indextoremove.back() + 1);
+		unsigned idx = 0, next = 0;
+		while (next < indextoremove.size() && sqlite3_step(stmt) == SQLITE_ROW) {
+			if (idx++ == indextoremove[next]) {
+				positions.push_back(sqlite3_column_int64(stmt, 0));
+				next++;
+			}
+		}
+		sqlite3_finalize(stmt);
+	}
+
+	sqlite3_prepare_v2(dbh, "DELETE FROM playlist_entries WHERE playlistid = ? AND position = ?",
+	                   -1, &stmt, NULL);
+	for (auto pos : positions) {
+		sqlite3_bind_int64(stmt, 1, pid);
+		sqlite3_bind_int64(stmt, 2, pos);
+		sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+
+	appendSongs(pid, songstoadd);
+	sqlite3_exec(dbh, "COMMIT", NULL, NULL, NULL);
+	bumpGeneration();
+}
+
+void UserData::deletePlaylist(uint64_t pid) {
+	std::lock_guard<std::mutex> g(dbmutex);
+	sqlite3_exec(dbh, "BEGIN", NULL, NULL, NULL);
+
+	for (auto sql : {"DELETE FROM playlist_entries WHERE playlistid = ?",
+	                 "DELETE FROM playlists WHERE `id` = ?"}) {
+		sqlite3_stmt *stmt;
+		sqlite3_prepare_v2(dbh, sql, -1, &stmt, NULL);
+		sqlite3_bind_int64(stmt, 1, pid);
+		sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+	}
+
+	sqlite3_exec(dbh, "COMMIT", NULL, NULL, NULL);
+	bumpGeneration();
 }
 
 std::unique_ptr<PlayList> UserData::getPlaylist(uint64_t pid) {
+	std::lock_guard<std::mutex> g(dbmutex);
 	sqlite3_stmt *stmt;
-	sqlite3_prepare_v2(dbh, "SELECT `id`, name, comment, user, public, songs "
+	sqlite3_prepare_v2(dbh, "SELECT `id`, name, comment, user, public, 0 "
 	                   "FROM playlists WHERE `id` = ?", -1, &stmt, NULL);
 	sqlite3_bind_int64(stmt, 1, pid);
 	PlayList *ret = nullptr;
 	if (sqlite3_step(stmt) == SQLITE_ROW)
 		ret = new PlayList(stmt);
 	sqlite3_finalize(stmt);
+
+	if (ret) {
+		// Ordered read straight from the primary key
+		sqlite3_prepare_v2(dbh, "SELECT songid FROM playlist_entries WHERE playlistid = ? "
+		                   "ORDER BY position", -1, &stmt, NULL);
+		sqlite3_bind_int64(stmt, 1, pid);
+		while (sqlite3_step(stmt) == SQLITE_ROW)
+			ret->songs.push_back(sqlite3_column_int64(stmt, 0));
+		sqlite3_finalize(stmt);
+		ret->songcount = ret->songs.size();
+	}
 	return std::unique_ptr<PlayList>(ret);
 }
 
 std::list<PlayList> UserData::getPlaylists(std::string user) {
+	std::lock_guard<std::mutex> g(dbmutex);
 	sqlite3_stmt *stmt;
-	sqlite3_prepare_v2(dbh, "SELECT `id`, name, comment, user, public, songs "
-	                   "FROM playlists WHERE user = ?", -1, &stmt, NULL);
+	sqlite3_prepare_v2(dbh, "SELECT `id`, name, comment, user, public, "
+	                   "(SELECT count(*) FROM playlist_entries WHERE playlistid = playlists.id) "
+	                   "FROM playlists WHERE user = ? OR public = 1", -1, &stmt, NULL);
 	sqlite3_bind_text(stmt, 1, user.c_str(), -1, NULL);
 	std::list<PlayList> ret;
 	while (sqlite3_step(stmt) == SQLITE_ROW)
@@ -87,3 +254,32 @@ std::list<PlayList> UserData::getPlaylists(std::string user) {
 	return ret;
 }
 
+void UserData::recordPlay(uint64_t albumid) {
+	std::lock_guard<std::mutex> g(dbmutex);
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(dbh, "INSERT INTO albumplays (albumid, playcount, lastplayed) "
+	                   "VALUES (?, 1, ?) ON CONFLICT(albumid) DO UPDATE SET "
+	                   "playcount = playcount + 1, lastplayed = excluded.lastplayed",
+	                   -1, &stmt, NULL);
+	sqlite3_bind_int64(stmt, 1, albumid);
+	sqlite3_bind_int64(stmt, 2, time(NULL));
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+}
+
+std::vector<uint64_t> UserData::getPlayedAlbums(bool recent, unsigned offset, unsigned size) {
+	std::lock_guard<std::mutex> g(dbmutex);
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(dbh, recent ?
+	                   "SELECT albumid FROM albumplays ORDER BY lastplayed DESC LIMIT ? OFFSET ?" :
+	                   "SELECT albumid FROM albumplays ORDER BY playcount DESC LIMIT ? OFFSET ?",
+	                   -1, &stmt, NULL);
+	sqlite3_bind_int64(stmt, 1, size);
+	sqlite3_bind_int64(stmt, 2, offset);
+	std::vector<uint64_t> ret;
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+		ret.push_back(sqlite3_column_int64(stmt, 0));
+
+	sqlite3_finalize(stmt);
+	return ret;
+}
@@ -3,29 +3,39 @@
 #define __USER_DATA__H__
 
 #include <list>
+#include <mutex>
+#include <atomic>
 #include <vector>
 #include <memory>
 #include <string>
 #include <stdint.h>
+#include <time.h>
 #include <sqlite3.h>
 
 class PlayList {
 public:
 	PlayList(sqlite3_stmt *);
 
-	// Flush changes to database
-	void flush(sqlite3 *db) const;
-
 	// Attrs
 	uint64_t id;
 	std::string name, comment, username;
 	bool upublic;
-	std::vector<uint64_t> songs;
+	unsigned songcount;
+	std::vector<uint64_t> songs;   // Only filled by getPlaylist
 };
 
 class UserData {
 private:
 	sqlite3 *dbh;
+	// Serializes transactions on the shared handle. Readers take it as well, a
+	// transaction is per connection so they would otherwise run inside it.
+	std::mutex dbmutex;
+	std::atomic<uint64_t> generation;    // Bumped on every playlist change
+	std::atomic<time_t> lastwrite;
+
+	void migratePlaylists();
+	void appendSongs(uint64_t pid, const std::vector<uint64_t> &songs);
+	void bumpGeneration();
 
 public:
 	UserData(sqlite3 *db);
@@ -36,6 +46,24 @@ public:
 
 	// Gets all playlists for a user, no auth as well.
 	std::list<PlayList> getPlaylists(std::string user);
+
+	// Playlist edits, each one runs in a single transaction. Removal indexes
+	// refer to positions in the playlist before any changes are made.
+	uint64_t createPlaylist(std::string user, std::string name,
+	                        const std::vector<uint64_t> &songs);
+	void setPlaylistSongs(uint64_t pid, const std::vector<uint64_t> &songs);
+	void updatePlaylist(uint64_t pid, const std::string *name, const std::string *comment,
+	                    const bool *upublic, const std::vector<uint64_t> &songstoadd,
+	                    std::vector<unsigned> indextoremove);
+	void deletePlaylist(uint64_t pid);
+
+	// Changes whenever playlists change (not persisted)
+	uint64_t getGeneration() const { return generation; }
+	time_t getLastWrite() const { return lastwrite; }
+
+	// Album play statistics (for frequent/recent album lists)
+	void recordPlay(uint64_t albumid);
+	std::vector<uint64_t> getPlayedAlbums(bool recent, unsigned offset, unsigned size);
 };
 
 
@@ -1,69 +1,201 @@
 
 
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "util.h"
 
+// Lookup tables for hex encoding/decoding, 0xff marks non-hex chars
+static const char hexchars[] = "0123456789abcdef";
+
+struct HexTables {
+	uint8_t dec[256];
+	char enc[256][2];
+	HexTables() {
+		memset(dec, 0xff, sizeof(dec));
+		for (unsigned i = 0; i < 10; i++)
+			dec['0' + i] = i;
+		for (unsigned i = 0; i < 6; i++)
+			dec['a' + i] = dec['A' + i] = 10 + i;
+		for (unsigned i = 0; i < 256; i++) {
+			enc[i][0] = hexchars[i >> 4];
+			enc[i][1] = hexchars[i & 15];
+		}
+	}
+};
+static const HexTables hextbl;
+
 unsigned char hexdec(char c) {
-	if (c >= '0' && c <= '9')
-		return c - '0';
-	else if (c >= 'a' && c <= 'f')
-		return c - 'a' + 10;
-	else if (c >= 'A' && c <= 'F')
-		return c - 'A' + 10;
-	return 0;
+	uint8_t r = hextbl.dec[(uint8_t)c];
+	return r == 0xff ? 0 : r;
 }
 
-std::string hexdecode(std::string s) {
+std::string hexdecode(const std::string &s) {
 	if (s.size() & 1)
 		return {};
-	std::string ret;
-	for (unsigned i = 0; i < s.size(); i += 2)
-		ret.push_back((char)((hexdec(s[i]) << 4) | hexdec(s[i+1])));
+	std::string ret(s.size() / 2, '\0');
+	for (unsigned i = 0; i < ret.size(); i++)
+		ret[i] = (char)((hexdec(s[2*i]) << 4) | hexdec(s[2*i+1]));
 	return ret;
 }
 
-uint64_t hexdecode64(std::string s) {
+uint64_t hexdecode64(const char *s, size_t len) {
 	uint64_t ret = 0;
-	for (char c : s) {
-		ret <<= 4;
-		ret |= hexdec(c);
-	}
+	for (size_t i = 0; i < len; i++)
+		ret = (ret << 4) | hexdec(s[i]);
 	return ret;
 }
 
-std::string hexencode64(uint64_t n) {
-	const static char hcs[] = "0123456789abcdef";
-	std::string ret;
-	for (unsigned i = 0; i < 16; i++) {
-		ret = hcs[n & 15] + ret;
-		n >>= 4;
+uint64_t hexdecode64(const std::string &s) {
+	return hexdecode64(s.data(), s.size());
+}
+
+void hexencode64(uint64_t n, char *out) {
+	// Two chars per byte, most significant byte first
+	for (int i = 7; i >= 0; i--) {
+		memcpy(&out[i*2], hextbl.enc[n & 0xff], 2);
+		n >>= 8;
 	}
-	return ret;
 }
 
-std::string urldec(const std::string &s) {
-	std::string ret;
-	for (unsigned i = 0; i < s.size(); i++) {
-		if (s[i] == '%' && i + 2 < s.size()) {
-			ret += hexdecode(s.substr(i+1, 2));
+std::string hexencode64(uint64_t n) {
+	char tmp[16];
+	hexencode64(n, tmp);
+	return std::string(tmp, 16);
+}
+
+size_t urldec(const char *s, size_t len, char *out) {
+	size_t o = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] == '%' && i + 2 < len) {
+			out[o++] = (char)((hexdec(s[i+1]) << 4) | hexdec(s[i+2]));
 			i += 2;
 		}
 		else
-			ret.push_back(s[i]);
+			out[o++] = s[i];
 	}
+	return o;
+}
+
+std::string urldec(const char *s, size_t len) {
+	// Fast path, nothing to decode
+	if (!memchr(s, '%', len))
+		return std::string(s, len);
+
+	std::string ret(len, '\0');
+	ret.resize(urldec(s, len, &ret[0]));
 	return ret;
 }
 
-std::string cescape(std::string content, bool isxml) {
+std::string urldec(const std::string &s) {
+	return urldec(s.data(), s.size());
+}
+
+// Returns the offset of the first char that needs escaping (or len if none).
+// Control chars need escaping in both formats, plus the format specials.
+template<bool isxml>
+static inline bool needs_escape(unsigned char c) {
+	if (isxml)
+		return c < 0x20 || c == '"' || c == '&' || c == '<' || c == '>';
+	return c < 0x20 || c == '"' || c == '\\';
+}
+
+template<bool isxml>
+static size_t escape_scan(const char *s, size_t len) {
+	size_t i = 0;
+	#ifdef __SSE2__
+	// Check 16 bytes at a time, most strings have nothing to escape
+	const __m128i ctrl = _mm_set1_epi8(0x1f);
+	const __m128i quot = _mm_set1_epi8('"');
+	const __m128i c1 = _mm_set1_epi8(isxml ? '&' : '\\');
+	const __m128i c2 = _mm_set1_epi8(isxml ? '<' : '\\');
+	const __m128i c3 = _mm_set1_epi8(isxml ? '>' : '\\');
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)&s[i]);
+		__m128i m = _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v);
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, quot));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, c1));
+		if (isxml) {
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(v, c2));
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(v, c3));
+		}
+		unsigned mask = _mm_movemask_epi8(m);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	#endif
+	for (; i < len; i++)
+		if (needs_escape<isxml>(s[i]))
+			return i;
+	return len;
+}
+
+template<bool isxml>
+static std::string escape(const std::string &content) {
+	size_t p = escape_scan<isxml>(content.data(), content.size());
+	if (p == content.size())
+		return content;
+
 	std::string escaped;
-	for (auto c: content)
-		if (c == '"') escaped += "&quot;";
-		else if (isxml && c == '<') escaped += "&lt;";
-		else if (isxml && c == '>') escaped += "&gt;";
-		else if (isxml && c == '&') escaped += "&amp;";
-		else escaped += c;
+	escaped.reserve(content.size() + content.size() / 8 + 8);
+	size_t start = 0;
+	while (p < content.size()) {
+		// Bulk copy the clean run, then escape the offending char
+		escaped.append(content, start, p - start);
+		unsigned char c = content[p];
+		if (isxml) {
+			switch (c) {
+			case '"':  escaped += "&quot;"; break;
+			case '&':  escaped += "&amp;";  break;
+			case '<':  escaped += "&lt;";   break;
+			case '>':  escaped += "&gt;";   break;
+			case '\t': escaped += "&#9;";   break;
+			case '\n': escaped += "&#10;";  break;
+			case '\r': escaped += "&#13;";  break;
+			default:   break;  // Other control chars are not valid XML 1.0
+			};
+		}
+		else {
+			switch (c) {
+			case '"':  escaped += "\\\""; break;
+			case '\\': escaped += "\\\\"; break;
+			case '\b': escaped += "\\b";  break;
+			case '\f': escaped += "\\f";  break;
+			case '\n': escaped += "\\n";  break;
+			case '\r': escaped += "\\r";  break;
+			case '\t': escaped += "\\t";  break;
+			default: {
+				char tmp[8];
+				snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+				escaped += tmp;
+				} break;
+			};
+		}
+		start = ++p;
+		p += escape_scan<isxml>(&content[p], content.size() - p);
+	}
+	escaped.append(content, start, std::string::npos);
 	return escaped;
 }
 
+std::string xmlescape(const std::string &content) {
+	return escape<true>(content);
+}
+
+std::string jsonescape(const std::string &content) {
+	return escape<false>(content);
+}
+
+std::string cescape(const std::string &content, bool isxml) {
+	return isxml ? xmlescape(content) : jsonescape(content);
+}
+
 std::string base64Decode(const std::string & input) {
 	if (input.length() % 4)
 		return "";
@@ -105,39 +237,295 @@ std::string base64Decode(const std::string & input) {
 	return ret;
 }
 
-std::unordered_multimap<std::string, std::string> parse_vars(std::string body) {
+std::unordered_multimap<std::string, std::string> parse_vars(const std::string &body) {
 	std::unordered_multimap<std::string, std::string> vars;
+	tokenize_vars(body.data(), body.size(),
+		[&vars] (const char *k, size_t klen, const char *v, size_t vlen) {
+			vars.emplace(urldec(k, klen), urldec(v, vlen));
+		});
+	return vars;
+}
+
+const char * const ignored_articles = "The El La Los Las Le Les";
+
+// Latin-1 and Latin Extended-A letters, folded to their lowercase base letters
+static const struct {
+	uint16_t from, to;
+	const char *repl;
+} foldtbl[] = {
+	{0x00C0, 0x00C5, "a"}, {0x00C6, 0x00C6, "ae"}, {0x00C7, 0x00C7, "c"},
+	{0x00C8, 0x00CB, "e"}, {0x00CC, 0x00CF, "i"}, {0x00D0, 0x00D0, "d"},
+	{0x00D1, 0x00D1, "n"}, {0x00D2, 0x00D6, "o"}, {0x00D8, 0x00D8, "o"},
+	{0x00D9, 0x00DC, "u"}, {0x00DD, 0x00DD, "y"}, {0x00DE, 0x00DE, "th"},
+	{0x00DF, 0x00DF, "ss"}, {0x00E0, 0x00E5, "a"}, {0x00E6, 0x00E6, "ae"},
+	{0x00E7, 0x00E7, "c"}, {0x00E8, 0x00EB, "e"}, {0x00EC, 0x00EF, "i"},
+	{0x00F0, 0x00F0, "d"}, {0x00F1, 0x00F1, "n"}, {0x00F2, 0x00F6, "o"},
+	{0x00F8, 0x00F8, "o"}, {0x00F9, 0x00FC, "u"}, {0x00FD, 0x00FD, "y"},
+	{0x00FE, 0x00FE, "th"}, {0x00FF, 0x00FF, "y"},
+	{0x0100, 0x0105, "a"}, {0x0106, 0x010D, "c"}, {0x010E, 0x0111, "d"},
+	{0x0112, 0x011B, "e"}, {0x011C, 0x0123, "g"}, {0x0124, 0x0127, "h"},
+	{0x0128, 0x0131, "i"}, {0x0132, 0x0133, "ij"}, {0x0134, 0x0135, "j"},
+	{0x0136, 0x0138, "k"}, {0x0139, 0x0142, "l"}, {0x0143, 0x014B, "n"},
+	{0x014C, 0x0151, "o"}, {0x0152, 0x0153, "oe"}, {0x0154, 0x0159, "r"},
+	{0x015A, 0x0161, "s"}, {0x0162, 0x0167, "t"}, {0x0168, 0x0173, "u"},
+	{0x0174, 0x0175, "w"}, {0x0176, 0x0178, "y"}, {0x0179, 0x017E, "z"},
+	{0x017F, 0x017F, "s"},
+};
+
+static void utf8_append(std::string &out, uint32_t cp) {
+	if (cp < 0x80)
+		out.push_back(cp);
+	else if (cp < 0x800) {
+		out.push_back(0xC0 | (cp >> 6));
+		out.push_back(0x80 | (cp & 0x3F));
+	}
+	else if (cp < 0x10000) {
+		out.push_back(0xE0 | (cp >> 12));
+		out.push_back(0x80 | ((cp >> 6) & 0x3F));
+		out.push_back(0x80 | (cp & 0x3F));
+	}
+	else {
+		out.push_back(0xF0 | (cp >> 18));
+		out.push_back(0x80 | ((cp >> 12) & 0x3F));
+		out.push_back(0x80 | ((cp >> 6) & 0x3F));
+		out.push_back(0x80 | (cp & 0x3F));
+	}
+}
+
+// Decodes the UTF-8 char at i, advancing it. Returns false for ASCII and
+// invalid bytes (cp is then the byte itself).
+static bool utf8_next(const std::string &s, size_t &i, uint32_t *cp) {
+	unsigned char c = s[i];
+	unsigned len = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
+	if (len == 1 || i + len > s.size()) {
+		*cp = c;
+		i++;
+		return false;
+	}
+	*cp = c & (0x7F >> len);
+	for (unsigned j = 1; j < len; j++)
+		*cp = (*cp << 6) | (s[i+j] & 0x3F);
+	i += len;
+	return true;
+}
+
+// Accented Greek letters (tonos, dialytika) and final sigma, to their base capital
+static const uint16_t greekbase[][2] = {
+	{0x0386, 0x0391}, {0x0388, 0x0395}, {0x0389, 0x0397}, {0x038A, 0x0399},
+	{0x038C, 0x039F}, {0x038E, 0x03A5}, {0x038F, 0x03A9}, {0x0390, 0x0399},
+	{0x03AA, 0x0399}, {0x03AB, 0x03A5}, {0x03AC, 0x0391}, {0x03AD, 0x0395},
+	{0x03AE, 0x0397}, {0x03AF, 0x0399}, {0x03B0, 0x03A5}, {0x03C2, 0x03A3},
+	{0x03CA, 0x0399}, {0x03CB, 0x03A5}, {0x03CC, 0x039F}, {0x03CD, 0x03A5},
+	{0x03CE, 0x03A9},
+};
+
+std::string sortkey(const std::string &s) {
+	// Casefold and strip accents (Latin, Greek and Cyrillic)
+	std::string key;
+	key.reserve(s.size());
+	for (size_t i = 0; i < s.size(); ) {
+		uint32_t cp;
+		if (!utf8_next(s, i, &cp)) {
+			// ASCII (or an invalid byte, kept as is)
+			key.push_back(cp < 0x80 ? tolower(cp) : cp);
+			continue;
+		}
+
+		const char *repl = nullptr;
+		for (const auto & f : foldtbl)
+			if (cp >= f.from && cp <= f.to)
+				repl = f.repl;
+		if (repl)
+			key += repl;
+		else {
+			for (const auto & g : greekbase)
+				if (cp == g[0])
+					cp = g[1];
+			if (cp >= 0x0391 && cp <= 0x03A9)       // Greek
+				cp += 0x20;
+			else if (cp >= 0x0410 && cp <= 0x042F)  // Cyrillic
+				cp += 0x20;
+			else if (cp >= 0x0400 && cp <= 0x040F)
+				cp += 0x50;
+			utf8_append(key, cp);
+		}
+	}
+
+	// Skip leading punctuation/spaces, then any leading article
 	size_t p = 0;
-	while (1) {
-		size_t pe = body.find('&', p);
-		std::string curv = pe != std::string::npos ? body.substr(p, pe - p) : body.substr(p);
-		size_t peq = curv.find('=');
-		if (peq != std::string::npos)
-			vars.emplace(urldec(curv.substr(0, peq)), urldec(curv.substr(peq+1)));
-		if (pe == std::string::npos)
+	while (p < key.size() && (unsigned char)key[p] < 0x80 && !isalnum(key[p]))
+		p++;
+	for (const char *a = ignored_articles; *a; ) {
+		const char *e = strchr(a, ' ') ?: a + strlen(a);
+		size_t alen = e - a;
+		if (key.size() > p + alen + 1 && key[p + alen] == ' ' &&
+		    !strncasecmp(&key[p], a, alen)) {
+			p += alen;
+			while (p < key.size() && isspace((unsigned char)key[p]))
+				p++;
 			break;
-		p = pe + 1;
+		}
+		a = *e ? e + 1 : e;
 	}
+	return p < key.size() ? key.substr(p) : key;
+}
 
-	return vars;
+std::string indexletter(const std::string &key) {
+	if (key.empty())
+		return "#";
+
+	size_t i = 0;
+	uint32_t cp;
+	if (!utf8_next(key, i, &cp))
+		return cp < 0x80 && isalpha(cp) ? std::string(1, toupper(cp)) : "#";
+
+	// Latin letters (if not folded already) go to their base letter
+	for (const auto & f : foldtbl)
+		if (cp >= f.from && cp <= f.to)
+			return std::string(1, toupper(f.repl[0]));
+
+	// Undo the sortkey lowercasing for Greek and Cyrillic
+	for (const auto & g : greekbase)
+		if (cp == g[0])
+			cp = g[1];
+	if (cp >= 0x03B1 && cp <= 0x03C9)
+		cp -= 0x20;
+	else if (cp >= 0x0430 && cp <= 0x044F)
+		cp -= 0x20;
+	else if (cp >= 0x0450 && cp <= 0x045F)
+		cp -= 0x50;
+
+	// Anything else (symbols, other scripts) is bucketed with the non letters
+	bool greek = cp >= 0x0391 && cp <= 0x03A9 && cp != 0x03A2;
+	bool cyrillic = cp >= 0x0400 && cp <= 0x042F;
+	if (!greek && !cyrillic)
+		return "#";
+	std::string ret;
+	utf8_append(ret, cp);
+	return ret;
+}
+
+std::string isotime(uint64_t ts) {
+	time_t t = ts;
+	struct tm tmv;
+	char buf[32];
+	gmtime_r(&t, &tmv);
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S.000Z", &tmv);
+	return buf;
+}
+
+std::string httpdate(time_t t) {
+	struct tm tmv;
+	char buf[64];
+	gmtime_r(&t, &tmv);
+	strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tmv);
+	return buf;
+}
+
+time_t parse_httpdate(const std::string &s) {
+	struct tm tmv;
+	memset(&tmv, 0, sizeof(tmv));
+	if (!strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tmv))
+		return 0;
+	return timegm(&tmv);
+}
+
+uint64_t seektable_lookup(const std::string &table, uint64_t ms, uint64_t *prefix) {
+	const uint8_t *t = (const uint8_t*)table.data();
+	*prefix = 0;
+	if (table.size() < 12)
+		return 0;
+	*prefix = a2i32(t);
+
+	// Binary search the last entry with time <= ms
+	const uint8_t *entries = &t[4];
+	size_t lo = 0, hi = (table.size() - 4) / 8;
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if (a2i32(&entries[mid * 8]) <= ms)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	if (a2i32(&entries[lo * 8]) > ms)
+		return 0;
+	return a2i32(&entries[lo * 8 + 4]);
+}
+
+// Parses a decimal number, all chars must be digits (no sign, no spaces)
+static bool parse_u64(const std::string &s, uint64_t *r) {
+	if (s.empty() || s.size() > 19)
+		return false;
+	*r = 0;
+	for (char c : s) {
+		if (c < '0' || c > '9')
+			return false;
+		*r = *r * 10 + (c - '0');
+	}
+	return true;
 }
 
-std::pair<uint64_t, uint64_t> parse_range(std::string h) {
-	// h is like bytes=X-Y (we ignore other formats)
-	if (h.size() < 8 || h.substr(0, 6) != "bytes=")
-		return {0, ~0ULL};
+bool parse_range(const std::string &h, uint64_t total, range_list *ranges) {
+	const unsigned max_ranges = 16;
+	ranges->clear();
+	if (h.size() < 7 || strncasecmp(h.c_str(), "bytes=", 6))
+		return false;
 
-	h = h.substr(6);
-	uint64_t startoff = atoll(h.c_str());
+	unsigned nspecs = 0;
+	size_t p = 6;
+	while (p <= h.size()) {
+		size_t e = h.find(',', p);
+		if (e == std::string::npos)
+			e = h.size();
+		std::string spec = h.substr(p, e - p);
+		p = e + 1;
 
-	auto p = h.find('-');
-	if (p == std::string::npos)
-		return {0, ~0ULL};
+		// Trim optional whitespace and skip empty list elements
+		spec.erase(0, spec.find_first_not_of(" \t"));
+		spec.erase(spec.find_last_not_of(" \t") + 1);
+		if (spec.empty())
+			continue;
+		if (++nspecs > max_ranges)
+			return false;
 
-	uint64_t csize = atoll(&h[p+1]);
-	if (h.size() <= p+1)
-		csize = ~0ULL;
+		auto dash = spec.find('-');
+		if (dash == std::string::npos)
+			return false;
 
-	return {startoff, csize};
+		uint64_t first, last;
+		if (dash == 0) {
+			// Suffix range: last N bytes
+			if (!parse_u64(spec.substr(1), &last))
+				return false;
+			if (!last || !total)
+				continue;   // Unsatisfiable
+			ranges->emplace_back(total > last ? total - last : 0, total - 1);
+		}
+		else {
+			if (!parse_u64(spec.substr(0, dash), &first))
+				return false;
+			if (dash + 1 == spec.size())
+				last = ~0ULL;
+			else if (!parse_u64(spec.substr(dash + 1), &last) || last < first)
+				return false;
+			if (first >= total)
+				continue;   // Unsatisfiable
+			ranges->emplace_back(first, std::min(last, total - 1));
+		}
+	}
+	if (!nspecs)
+		return false;
+
+	// Sort and coalesce overlapping or adjacent ranges
+	std::sort(ranges->begin(), ranges->end());
+	range_list merged;
+	for (const auto & r : *ranges) {
+		if (!merged.empty() && r.first <= merged.back().second + 1)
+			merged.back().second = std::max(merged.back().second, r.second);
+		else
+			merged.push_back(r);
+	}
+	ranges->swap(merged);
+	return true;
 }
 
@@ -3,33 +3,103 @@
 #define __UTIL_HDR_H__
 
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <string>
+#include <vector>
 #include <unordered_map>
 
 // Decodes hex -> bin
 unsigned char hexdec(char c);
-std::string hexdecode(std::string s);
+std::string hexdecode(const std::string &s);
 
-// 64 bit num hex encoded
+// 64 bit num hex encoded, the raw variant writes exactly 16 chars to out
 std::string hexencode64(uint64_t n);
-uint64_t hexdecode64(std::string s);
+void hexencode64(uint64_t n, char *out);
+uint64_t hexdecode64(const std::string &s);
+uint64_t hexdecode64(const char *s, size_t len);
 
-// Decodes a URL to its original string
+// Decodes a URL to its original string. The raw variant writes to out (which
+// needs len bytes at most, can be the input itself) and returns the output size
 std::string urldec(const std::string &s);
+std::string urldec(const char *s, size_t len);
+size_t urldec(const char *s, size_t len, char *out);
 
-// Escapes strings (for XML and JSON)
-std::string cescape(std::string content, bool isxml = false);
+// Escapes strings for XML attributes and JSON strings
+std::string xmlescape(const std::string &content);
+std::string jsonescape(const std::string &content);
+std::string cescape(const std::string &content, bool isxml = false);
 
 // Decodes a base64 encoded string to a war byte buffer
 std::string base64Decode(const std::string & input);
 
 // Parses variables in the body of a request, or in a GET query
-std::unordered_multimap<std::string, std::string> parse_vars(std::string body);
+std::unordered_multimap<std::string, std::string> parse_vars(const std::string &body);
 
-// Parses a Range Header expression into byte ranges
-std::pair<uint64_t, uint64_t> parse_range(std::string h);
+// Splits a query string into key/value pairs (still URL encoded) pointing into
+// the input buffer, calling cb(key, keylen, value, valuelen) for each of them.
+// No allocations involved (the callback is not wrapped in a std::function).
+template<typename F>
+void tokenize_vars(const char *q, size_t len, F cb) {
+	const char *end = q + len;
+	while (q < end) {
+		const char *pe = (const char*)memchr(q, '&', end - q);
+		if (!pe)
+			pe = end;
+		const char *peq = (const char*)memchr(q, '=', pe - q);
+		if (peq)
+			cb(q, peq - q, peq + 1, pe - peq - 1);
+		q = pe + 1;
+	}
+}
+
+// Articles ignored when sorting (as advertised to clients)
+extern const char * const ignored_articles;
+
+// Sort key for artist/album names: casefolded, without accents and without
+// leading punctuation or articles. Compares bytewise.
+std::string sortkey(const std::string &s);
+
+// Index bucket for a sort key: uppercase first letter (Latin, Greek or
+// Cyrillic, without accents), or '#' for anything else
+std::string indexletter(const std::string &key);
+
+// Formats a unix timestamp as ISO 8601 (UTC), as used in "created" fields
+std::string isotime(uint64_t ts);
+
+// Formats/parses HTTP dates (RFC 7231), parsing returns 0 on error
+std::string httpdate(time_t t);
+time_t parse_httpdate(const std::string &s);
+
+// Parses a Range header ("bytes=a-b,c-,-n") for a resource of "total" bytes.
+// Returns false when the whole resource should be served (no header, bad
+// syntax or too many ranges). Otherwise it fills "ranges" with the sorted and
+// merged satisfiable ranges (inclusive), which can be empty (416 response).
+typedef std::vector<std::pair<uint64_t, uint64_t>> range_list;
+bool parse_range(const std::string &h, uint64_t total, range_list *ranges);
+
+// Seek tables map playback times to byte offsets. They are stored as a blob
+// of LE uint32s: the prefix length (bytes at the start of the file that must
+// precede any seek point, like Ogg headers) followed by (ms, offset) pairs
+// sorted by time. Returns the offset of the last seek point at or before "ms"
+// (0 if none) and sets the prefix length.
+uint64_t seektable_lookup(const std::string &table, uint64_t ms, uint64_t *prefix);
 
 // Some inline stuff, LE magic
+static uint32_t a2i32(const uint8_t *h) {
+	return  ((uint32_t)h[0] <<  0) |
+	        ((uint32_t)h[1] <<  8) |
+	        ((uint32_t)h[2] << 16) |
+	        ((uint32_t)h[3] << 24);
+}
+
+static std::string i322a(uint32_t n) {
+	std::string r(4, 0);
+	for (unsigned i = 0; i < 4; i++)
+		r[i] = n >> (i << 3);
+	return r;
+}
+
 static uint64_t a2i64(const uint8_t *h) {
 	return  ((uint64_t)h[0] <<  0) |
 	        ((uint64_t)h[1] <<  8) |
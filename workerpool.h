@@ -0,0 +1,77 @@
+#ifndef _WORKERPOOL__H__
+#define _WORKERPOOL__H__
+
+#include <atomic>
+#include <string>
+
+#include "queue.h"
+
+// Queue for a class of requests served by a dedicated set of workers, so
+// slow requests (ie. streams) can't starve quick ones. The queue length is
+// bounded and the pool keeps track of its utilization. Requests are queued
+// per user and users are served in turns. Workers can park an item that has
+// to wait for something, it is resumed (queued again) later on.
+template<typename T>
+class WorkerPool {
+public:
+	WorkerPool(std::string name, unsigned nthreads, unsigned maxqueued)
+	  : name(name), nthreads(nthreads), maxqueued(maxqueued),
+	    queued(0), busy(0), parked(0), served(0), rejected(0) {}
+
+	unsigned threads() const { return nthreads; }
+
+	// Queues an item unless the queue is full (then the item is left as is)
+	bool push(const std::string &user, T &item) {
+		if (queued >= maxqueued) {
+			rejected++;
+			return false;
+		}
+		queued++;
+		q.push(user, std::move(item));
+		return true;
+	}
+
+	// Called by the workers to get work, and once they are done with it
+	bool pop(T *item) {
+		if (!q.pop(item))
+			return false;
+		queued--;
+		busy++;
+		return true;
+	}
+	void done() {
+		busy--;
+		served++;
+	}
+
+	// The worker set the item aside, resume() queues it again (always, it
+	// was admitted already)
+	void park() {
+		busy--;
+		parked++;
+	}
+	void resume(const std::string &user, T &item) {
+		parked--;
+		queued++;
+		q.push(user, std::move(item));
+	}
+
+	void close() { q.close(); }
+
+	std::string stats() const {
+		return name + " pool: " + std::to_string(busy) + "/" + std::to_string(nthreads) +
+		       " busy, " + std::to_string(queued) + "/" + std::to_string(maxqueued) +
+		       " queued, " + std::to_string(parked) + " parked, " + std::to_string(served) +
+		       " served, " + std::to_string(rejected) + " rejected";
+	}
+
+private:
+	const std::string name;
+	const unsigned nthreads, maxqueued;
+	FairQueue<T> q;
+	std::atomic<unsigned> queued, busy, parked;
+	std::atomic<uint64_t> served, rejected;
+};
+
+#endif
+